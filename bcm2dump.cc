@@ -19,8 +19,23 @@
 
 #include <stdexcept>
 #include <iostream>
+#include <cstring>
 #include <fstream>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <numeric>
+#include <thread>
 #include <unistd.h>
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <atomic>
+#include <csignal>
+#include <poll.h>
+#endif
 #include "interface.h"
 #include "progress.h"
 #include "rwx.h"
@@ -38,6 +53,8 @@ const unsigned opt_resume = 1;
 const unsigned opt_force = (1 << 1);
 const unsigned opt_safe = (1 << 2);
 const unsigned opt_force_write = (1 << 3);
+const unsigned opt_sparse = (1 << 4);
+const unsigned opt_incremental = (1 << 5);
 
 void usage(bool help = false)
 {
@@ -47,11 +64,18 @@ void usage(bool help = false)
 	os << endl;
 	os << "Options:" << endl;
 	os << "  -s               Always use safe (and slow) methods" << endl;
-	os << "  -R               Resume dump" << endl;
+	os << "  -R               Resume dump or write" << endl;
+	os << "  -S               Create sparse dump file" << endl;
+	os << "  -r <filename>    Reference file for dump" << endl;
+	os << "  -I               Write changed eraseblocks only" << endl;
+	os << "  -j <num>         Number of parallel telnet sessions for dump" << endl;
 	os << "  -F               Force operation" << endl;
 	os << "  -P <profile>     Force profile" << endl;
 	os << "  -L <filename>    I/O log file" << endl;
 	os << "  -O <opt>=<val>   Override option value" << endl;
+#ifndef _WIN32
+	os << "  -D <socket>      Run command using a daemon (see serve)" << endl;
+#endif
 	os << "  -q               Decrease verbosity" << endl;
 	os << "  -v               Increase verbosity" << endl;
 	os << endl;
@@ -60,7 +84,21 @@ void usage(bool help = false)
 	if (help) {
 		os << "\n    Dump data from given address space, starting at an explicit offset\n"
 				"    or alternately a partition name. If a partition name is used, the\n"
-				"    <size> argument may be omitted. Data is stored in file <out>.\n\n";
+				"    <size> argument may be omitted. Data is stored in file <out>.\n"
+				"    If a reference file is specified using -r, only those chunks\n"
+				"    that differ from the reference are transferred.\n\n";
+	}
+	os << "  hash  <interface> <addrspace> {<partition>[+<off>],<off>}[,<size>] [<algo>]" << endl;
+	if (help) {
+		os << "\n    Calculate the checksum of the given range. If possible, this is\n"
+				"    done on the target itself, without transferring the data.\n"
+				"    Currently, the only supported algorithm is crc32.\n\n";
+	}
+	os << "  verify <interface> <addrspace> {<partition>[+<off>],<off>}[,<size>] <in>" << endl;
+	if (help) {
+		os << "\n    Compare the given range with the contents of file <in>, and list\n"
+				"    all eraseblocks that differ. If possible, only blocks with a\n"
+				"    checksum mismatch are transferred.\n\n";
 	}
 	os << "  scan  <interface> <addrspace> <step> [<start> <size>]" << endl;
 	if (help) {
@@ -72,7 +110,8 @@ void usage(bool help = false)
 	if (help) {
 		os << "\n    Write data to the specified address space, starting at an explicit\n"
 				"    offset or alternately a partition name. The <size> argument may be\n"
-				"    specified to use only that number of bytes of file <in>.\n\n";
+				"    specified to use only that number of bytes of file <in>. With -I,\n"
+				"    only those eraseblocks that differ from <in> are written.\n\n";
 	}
 	os << "  exec  <interface> <off>[,<entry>] <in>" << endl;
 	if (help) {
@@ -95,6 +134,15 @@ void usage(bool help = false)
 		os << "\n    Print information about a profile. In the absence of a -P flag, use\n"
 				"    auto-detection.\n\n";
 	}
+#ifndef _WIN32
+	os << "  serve <socket>" << endl;
+	if (help) {
+		os << "\n    Run as a daemon, listening on Unix socket <socket>. Commands run\n"
+				"    using -D <socket> are executed by the daemon, which keeps all\n"
+				"    interfaces open between commands, so that interface detection,\n"
+				"    login and profile detection are only done once.\n\n";
+	}
+#endif
 	os << "  help" << endl;
 	if (help) {
 		os << "\n    Print this information and exit.\n";
@@ -149,6 +197,67 @@ void handle_sigint()
 	logger::w() << endl << "interrupted" << endl;
 }
 
+// when running as a daemon, interfaces and rwx objects are kept open
+// between commands. since their creation involves talking to the target,
+// this saves a lot of time when running many short commands.
+struct session
+{
+	interface::sp intf;
+	// (address space, safe) => rwx
+	map<pair<string, bool>, rwx::sp> rwxs;
+};
+
+bool serving = false;
+// profile and option overrides of the current command, which must
+// be identical for a session to be reused
+string session_opts;
+map<string, session> sessions;
+
+// `instance` distinguishes multiple sessions on the same interface
+interface::sp open_interface(const string& spec, const string& profile, unsigned instance = 0)
+{
+	if (!serving) {
+		return interface::create(spec, profile);
+	}
+
+	session& s = sessions[spec + "\n" + profile + "\n" + session_opts + "\n" + to_string(instance)];
+	if (!s.intf) {
+		s.intf = interface::create(spec, profile);
+	} else {
+		logger::d() << "reusing session " << spec << endl;
+	}
+
+	return s.intf;
+}
+
+rwx::sp open_rwx(const interface::sp& intf, const string& space, bool safe)
+{
+	for (auto& s : sessions) {
+		if (s.second.intf != intf) {
+			continue;
+		}
+
+		rwx::sp& rwx = s.second.rwxs[make_pair(space, safe)];
+		if (!rwx) {
+			rwx = rwx::create(intf, space, safe);
+		} else {
+			// undo everything that a previous command may have set
+			rwx->set_progress_listener();
+			rwx->set_image_listener();
+			rwx->set_partition(addrspace::part());
+			rwx->set_reference(nullptr);
+			rwx->set_journal(nullptr);
+			rwx->incremental(false);
+			rwx->sparse(false);
+			rwx->silent(false);
+		}
+
+		return rwx;
+	}
+
+	return rwx::create(intf, space, safe);
+}
+
 void image_listener(uint32_t offset, const ps_header& hdr)
 {
 	logger::i("  %s (0x%04x, %d b)\n", hdr.filename().c_str(), hdr.signature(), hdr.length());
@@ -287,8 +396,8 @@ int do_script(int argc, char** argv, int opts, const string& profile)
 		return 1;
 	}
 
-	auto intf = interface::create(argv[1], profile);
-	auto rwx = rwx::create(intf, argv[2], opts & opt_safe);
+	auto intf = open_interface(argv[1], profile);
+	auto rwx = open_rwx(intf, argv[2], opts & opt_safe);
 
 	if (argc == 3) {
 		// we're in interactive mode
@@ -317,7 +426,147 @@ int do_script(int argc, char** argv, int opts, const string& profile)
 }
 
 
-int do_dump(int argc, char** argv, int opts, const string& profile)
+// opens the journal for `file`. when resuming, completed ranges whose
+// contents in `file` no longer match are discarded.
+journal::sp open_journal(const string& file, const string& op, const string& space,
+		uint32_t offset, uint32_t length, uint32_t id, bool resume)
+{
+	journal::sp ret;
+
+	try {
+		ret = make_shared<journal>(file + ".journal", op, space, offset, length, id, resume);
+	} catch (const exception& e) {
+		logger::i() << e.what() << "; continuing without journal" << endl;
+		return nullptr;
+	}
+
+	if (resume && !ret->empty()) {
+		ifstream in(file, ios::binary);
+		ret->verify(in);
+	}
+
+	return ret;
+}
+
+// splits the range into stripes, which are dumped in parallel, using
+// one session per stripe.
+int do_dump_parallel(char** argv, int opts, const string& profile, unsigned jobs)
+{
+	// serial lines and raw tcp consoles only provide one console, so
+	// the sessions' commands would be interleaved
+	if (interface::spec_type(argv[1]) != "telnet") {
+		throw user_error("parallel dumps (-j) require a telnet connection, since serial and tcp consoles can only run one command at a time");
+	}
+
+	vector<interface::sp> intfs { open_interface(argv[1], profile) };
+	vector<rwx::sp> rwxs { open_rwx(intfs[0], argv[2], opts & opt_safe) };
+
+	if (intfs[0]->name() != "bfc" || !rwxs[0]->space().is_mem()) {
+		throw user_error("parallel dumps are only supported for memory on bfc interfaces");
+	}
+
+	uint32_t offset, length;
+	rwxs[0]->parse_spec(argv[3], offset, length);
+
+	vector<pair<uint32_t, uint32_t>> stripes;
+	uint32_t stripe = align_right((length + jobs - 1) / jobs, 0x10000);
+
+	for (uint32_t pos = offset; pos < (offset + length); pos += stripe) {
+		stripes.emplace_back(pos, min(stripe, offset + length - pos));
+	}
+
+	// skip profile auto-detection for all other sessions
+	string profile_name = intfs[0]->profile() ? intfs[0]->profile()->name() : profile;
+
+	for (size_t i = 1; i < stripes.size(); ++i) {
+		logger::v() << "opening session " << (i + 1) << endl;
+		intfs.push_back(open_interface(argv[1], profile_name, i));
+		rwxs.push_back(open_rwx(intfs[i], argv[2], opts & opt_safe));
+		rwxs[i]->set_partition(rwxs[0]->partition());
+	}
+
+	auto jrnl = open_journal(argv[4], "dump", argv[2], offset, length, 0, opts & opt_resume);
+	bool resume = (opts & opt_resume) && jrnl && !jrnl->empty();
+
+	if ((opts & opt_resume) && !resume) {
+		if (jrnl) {
+			jrnl->remove();
+		}
+
+		// the output file may have been written out of order
+		throw user_error("resuming a parallel dump requires a journal");
+	}
+
+	ios::openmode mode = ios::out | ios::binary | (resume ? ios::in : ios::trunc);
+	if (!ofstream(argv[4], mode).good()) {
+		throw user_error("failed to open "s + argv[4] + " for writing");
+	}
+
+	mutex lock;
+	bool failed = false;
+	exception_ptr error;
+	vector<uint32_t> done(stripes.size());
+	vector<thread> threads;
+	progress_listener listener("dumping", argv, offset, length);
+
+	cleaner sticky([] () {
+		rwx::set_interrupt_sticky(true);
+	}, [] () {
+		rwx::set_interrupt_sticky(false);
+		rwx::set_interrupted(false);
+	});
+
+	for (size_t i = 0; i < stripes.size(); ++i) {
+		rwxs[i]->sparse(opts & opt_sparse);
+		rwxs[i]->set_journal(jrnl);
+		rwxs[i]->set_progress_listener([&, i] (uint32_t off, uint32_t len, bool write, bool init) {
+			lock_guard<mutex> guard(lock);
+
+			if (failed) {
+				throw rwx::interrupted();
+			} else if (off == UINT32_MAX || logger::loglevel() > logger::info) {
+				return;
+			}
+
+			if (!init && off >= stripes[i].first) {
+				done[i] = min(off - stripes[i].first, stripes[i].second);
+			}
+
+			listener(offset + accumulate(done.begin(), done.end(), 0u), 0, false, init);
+		});
+
+		threads.emplace_back([&, i] () {
+			try {
+				fstream fs(argv[4], ios::in | ios::out | ios::binary);
+				fs.seekp(stripes[i].first - offset);
+				rwxs[i]->dump(stripes[i].first, stripes[i].second, fs, resume);
+			} catch (...) {
+				lock_guard<mutex> guard(lock);
+				if (!error) {
+					error = current_exception();
+				}
+				failed = true;
+			}
+		});
+	}
+
+	for (auto& t : threads) {
+		t.join();
+	}
+
+	if (error) {
+		rethrow_exception(error);
+	}
+
+	if (jrnl) {
+		jrnl->remove();
+	}
+
+	logger::i("\n");
+	return 0;
+}
+
+int do_dump(int argc, char** argv, int opts, const string& profile, const string& reference, unsigned jobs)
 {
 	if (argc != 5) {
 		usage(false);
@@ -328,11 +577,19 @@ int do_dump(int argc, char** argv, int opts, const string& profile)
 		throw user_error("output file "s + argv[4] + " exists; specify -F to overwrite or -R to resume dump");
 	}
 
-	auto intf = interface::create(argv[1], profile);
+	if (jobs > 1) {
+		if (!reference.empty()) {
+			throw user_error("reference files are not supported in parallel dumps");
+		}
+
+		return do_dump_parallel(argv, opts, profile, jobs);
+	}
+
+	auto intf = open_interface(argv[1], profile);
 	rwx::sp rwx;
 
 	if (argv[2] != "special"s) {
-		rwx = rwx::create(intf, argv[2], opts & opt_safe);
+		rwx = open_rwx(intf, argv[2], opts & opt_safe);
 	} else {
 		rwx = rwx::create_special(intf, argv[3]);
 	}
@@ -355,9 +612,30 @@ int do_dump(int argc, char** argv, int opts, const string& profile)
 		throw user_error("failed to open "s + argv[4] + " for writing");
 	}
 
+	rwx->sparse(opts & opt_sparse);
+
+	ifstream ref;
+	if (!reference.empty()) {
+		ref.open(reference, ios::binary);
+		if (!ref.good()) {
+			throw user_error("failed to open " + reference + " for reading");
+		}
+
+		rwx->set_reference(&ref);
+	}
+
 	if (argv[2] != "special"s) {
 		if (argv[3] != "dumpcode"s) {
-			rwx->dump(argv[3], of, opts & opt_resume);
+			uint32_t offset, length;
+			rwx->parse_spec(argv[3], offset, length);
+
+			auto jrnl = open_journal(argv[4], "dump", argv[2], offset, length, 0, opts & opt_resume);
+			rwx->set_journal(jrnl);
+			rwx->dump(offset, length, of, opts & opt_resume);
+
+			if (jrnl) {
+				jrnl->remove();
+			}
 		} else {
 			rwx->dump(intf->version().codecfg()["rwcode"] | intf->profile()->kseg1(), 512, of);
 		}
@@ -367,6 +645,84 @@ int do_dump(int argc, char** argv, int opts, const string& profile)
 	return 0;
 }
 
+int do_hash(int argc, char** argv, int opts, const string& profile)
+{
+	if (argc != 4 && argc != 5) {
+		usage(false);
+		return 1;
+	}
+
+	if (argc == 5 && argv[4] != "crc32"s) {
+		throw user_error("unsupported algorithm: "s + argv[4]);
+	}
+
+	auto intf = open_interface(argv[1], profile);
+	auto rwx = open_rwx(intf, argv[2], opts & opt_safe);
+
+	if (logger::loglevel() <= logger::info) {
+		rwx->set_progress_listener(progress_listener("hashing", argv));
+	}
+
+	uint32_t crc = rwx->hash(argv[3]);
+	logger::i("\n");
+	cout << to_hex(crc, 8) << endl;
+
+	return 0;
+}
+
+int do_verify(int argc, char** argv, int opts, const string& profile)
+{
+	if (argc != 5) {
+		usage(false);
+		return 1;
+	}
+
+	ifstream in(argv[4], ios::binary);
+	if (!in.good()) {
+		throw user_error("failed to open "s + argv[4] + " for reading");
+	}
+
+	auto intf = open_interface(argv[1], profile);
+	auto rwx = open_rwx(intf, argv[2], opts & opt_safe);
+
+	if (logger::loglevel() <= logger::info) {
+		rwx->set_progress_listener(progress_listener("verifying", argv));
+	}
+
+	auto ranges = rwx->diff(argv[3], in);
+	logger::i("\n");
+
+	uint32_t blocksize = rwx->space().blocksize();
+	if (!blocksize) {
+		blocksize = 64 * 1024;
+	}
+
+	// number of differing bytes per block
+	map<uint32_t, uint32_t> blocks;
+
+	for (auto r : ranges) {
+		logger::v("0x%08x-0x%08x differs (%u b)\n", r.first, r.first + r.second - 1, r.second);
+
+		for (uint32_t pos = r.first; pos < (r.first + r.second); ) {
+			uint32_t block = align_left(pos, blocksize);
+			uint32_t n = min(r.first + r.second, block + blocksize) - pos;
+			blocks[block] += n;
+			pos += n;
+		}
+	}
+
+	for (auto b : blocks) {
+		logger::i("0x%08x-0x%08x: %u bytes differ\n", b.first, b.first + blocksize - 1, b.second);
+	}
+
+	if (blocks.empty()) {
+		logger::i("contents match\n");
+		return 0;
+	}
+
+	return 1;
+}
+
 int do_write_exec(int argc, char** argv, int opts, const string& profile)
 {
 	bool exec = (argv[0] == "exec"s);
@@ -397,8 +753,9 @@ int do_write_exec(int argc, char** argv, int opts, const string& profile)
 		throw user_error("failed to open " + file + " for reading");
 	}
 
-	auto intf = interface::create(argv[1], profile);
-	auto rwx = rwx::create(intf, exec ? "ram" : argv[2], opts & opt_safe);
+	auto intf = open_interface(argv[1], profile);
+	auto rwx = open_rwx(intf, exec ? "ram" : argv[2], opts & opt_safe);
+	rwx->incremental(opts & opt_incremental);
 
 	progress pg;
 
@@ -422,8 +779,27 @@ int do_write_exec(int argc, char** argv, int opts, const string& profile)
 		rwx->exec(entry);
 		// TODO print all subsequent output ?
 	} else {
-		rwx->write(argv[3], in);
+		uint32_t offset, length;
+		rwx->parse_spec(argv[3], offset, length, true);
+
+		// the journal is only valid for the same data
+		string data((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+		if (!length) {
+			length = data.size();
+		}
+
+		in.clear();
+		in.seekg(0);
+
+		auto jrnl = open_journal(file, "write", argv[2], offset, length,
+				crc32(data.substr(0, length)), opts & opt_resume);
+		rwx->set_journal(jrnl);
+		rwx->write(offset, in, length);
 		logger::i("\n");
+
+		if (jrnl) {
+			jrnl->remove();
+		}
 	}
 
 	return 0;
@@ -436,7 +812,7 @@ int do_run(int argc, char** argv, const string& profile)
 		return 1;
 	}
 
-	auto intf = interface::create(argv[1], profile);
+	auto intf = open_interface(argv[1], profile);
 	auto cli = dynamic_pointer_cast<cmdline_interface>(intf);
 	if (!cli) {
 		throw user_error("not a commandline interface");
@@ -459,7 +835,7 @@ int do_info(int argc, char** argv, const string& profile)
 	}
 
 	if (argc == 2) {
-		auto intf = interface::create(argv[1], profile);
+		auto intf = open_interface(argv[1], profile);
 		if (intf->profile()) {
 			intf->profile()->print_to_stdout();
 		}
@@ -479,8 +855,8 @@ int do_scan(int argc, char** argv, int opts, const string& profile)
 		return 1;
 	}
 
-	auto intf = interface::create(argv[1], profile);
-	auto rwx = rwx::create(intf, argv[2], opts & opt_safe);
+	auto intf = open_interface(argv[1], profile);
+	auto rwx = open_rwx(intf, argv[2], opts & opt_safe);
 
 	if (!intf->profile() && argc != 6) {
 		throw user_error("unknown profile, must specify <start> and <size>");
@@ -526,12 +902,364 @@ int do_scan(int argc, char** argv, int opts, const string& profile)
 	return 0;
 }
 
+
+#ifndef _WIN32
+// a request to the daemon consists of its length (32 bits, host byte order),
+// followed by the client's working directory and its command line, each
+// NUL-terminated. the client's stdin, stdout and stderr are passed along
+// with the first byte, so the daemon can use them directly. once the
+// command has completed, the daemon replies with its exit code (8 bits).
+
+sockaddr_un make_sockaddr(const string& path)
+{
+	sockaddr_un sa = {};
+
+	if (path.size() >= sizeof(sa.sun_path)) {
+		throw user_error("socket path too long: " + path);
+	}
+
+	sa.sun_family = AF_UNIX;
+	path.copy(sa.sun_path, path.size());
+	return sa;
+}
+
+bool write_all(int fd, const char* buf, size_t len)
+{
+	while (len) {
+		ssize_t n = ::write(fd, buf, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n <= 0) {
+			return false;
+		}
+
+		buf += n;
+		len -= n;
+	}
+
+	return true;
+}
+
+bool read_all(int fd, char* buf, size_t len)
+{
+	while (len) {
+		ssize_t n = ::read(fd, buf, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n <= 0) {
+			return false;
+		}
+
+		buf += n;
+		len -= n;
+	}
+
+	return true;
+}
+
+int do_client(const string& path, int argc, char** argv)
+{
+	sockaddr_un sa = make_sockaddr(path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		throw errno_error("socket");
+	}
+
+	if (connect(fd, reinterpret_cast<sockaddr*>(&sa), sizeof(sa)) != 0) {
+		errno_error e("connect: " + path);
+		close(fd);
+		throw e;
+	}
+
+	char cwd[4096];
+	if (!getcwd(cwd, sizeof(cwd))) {
+		throw errno_error("getcwd");
+	}
+
+	string req(sizeof(uint32_t), '\0');
+	req.append(cwd, strlen(cwd) + 1);
+
+	for (int i = 0; i < argc; ++i) {
+		req.append(argv[i], strlen(argv[i]) + 1);
+	}
+
+	uint32_t len = req.size() - sizeof(uint32_t);
+	req.replace(0, sizeof(len), reinterpret_cast<const char*>(&len), sizeof(len));
+
+	int fds[] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+	char cbuf[CMSG_SPACE(sizeof(fds))] = {};
+
+	iovec iov = { &req[0], 1 };
+	msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	if (sendmsg(fd, &msg, 0) != 1 || !write_all(fd, req.data() + 1, req.size() - 1)) {
+		errno_error e("sendmsg");
+		close(fd);
+		throw e;
+	}
+
+	// the daemon writes to our stdout and stderr directly, so all that's
+	// left to do is to wait for the exit code. if we're interrupted, the
+	// daemon notices that the connection was closed.
+	char code;
+	bool ok = read_all(fd, &code, 1);
+	close(fd);
+
+	if (!ok) {
+		throw runtime_error("lost connection to daemon");
+	}
+
+	return code;
+}
+
+// returns the strings in a request. `fds` receives the client's stdin,
+// stdout and stderr.
+vector<string> read_request(int fd, int* fds)
+{
+	uint32_t len;
+	char cbuf[CMSG_SPACE(3 * sizeof(int))] = {};
+
+	iovec iov = { &len, sizeof(len) };
+	msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	ssize_t n = recvmsg(fd, &msg, 0);
+	if (n <= 0) {
+		throw errno_error("recvmsg");
+	}
+
+	cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+			|| cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int))) {
+		throw runtime_error("no file descriptors received");
+	}
+
+	memcpy(fds, CMSG_DATA(cmsg), 3 * sizeof(int));
+
+	if (!read_all(fd, reinterpret_cast<char*>(&len) + n, sizeof(len) - n)
+			|| !len || len > 0x100000) {
+		throw runtime_error("invalid request length");
+	}
+
+	string buf(len, '\0');
+	if (!read_all(fd, &buf[0], len) || buf.back()) {
+		throw runtime_error("invalid request");
+	}
+
+	vector<string> strings;
+	for (size_t i = 0; i < buf.size(); i += strings.back().size() + 1) {
+		strings.emplace_back(buf.c_str() + i);
+	}
+
+	return strings;
+}
+
+void reset_getopt()
+{
+#ifdef __GLIBC__
+	optind = 0;
+#else
+	optreset = 1;
+	optind = 1;
+#endif
+}
+
+int run_main(int argc, char** argv);
+
+void handle_client(int client)
+{
+	int fds[3] = { -1, -1, -1 };
+	vector<string> args;
+
+	try {
+		args = read_request(client, fds);
+		if (args.size() < 2) {
+			throw runtime_error("empty command line");
+		}
+	} catch (const exception& e) {
+		logger::w() << "invalid request: " << e.what() << endl;
+
+		for (int fd : fds) {
+			if (fd >= 0) {
+				close(fd);
+			}
+		}
+
+		return;
+	}
+
+	logger::v() << "running";
+	for (size_t i = 2; i < args.size(); ++i) {
+		logger::v() << " " << args[i];
+	}
+	logger::v() << endl;
+
+	cout.flush();
+	cerr.flush();
+
+	int saved[3];
+	for (int i = 0; i < 3; ++i) {
+		saved[i] = dup(i);
+		dup2(fds[i], i);
+		close(fds[i]);
+	}
+
+	int loglevel = logger::loglevel();
+	int ret = 1;
+
+	// restored after the command, along with everything else that
+	// the client's command line may have changed
+	int cwd = open(".", O_RDONLY);
+	if (cwd < 0) {
+		logger::e() << "error: " << errno_error("open: .").what() << endl;
+	} else if (chdir(args[0].c_str()) != 0) {
+		logger::e() << "error: " << errno_error("chdir: " + args[0]).what() << endl;
+	} else {
+		vector<char*> argv;
+		for (size_t i = 1; i < args.size(); ++i) {
+			argv.push_back(&args[i][0]);
+		}
+		argv.push_back(nullptr);
+
+		// the client closes the connection if it's interrupted
+		atomic<bool> done(false);
+		thread watcher([client, &done] () {
+			pollfd pfd = { client, POLLIN, 0 };
+			while (!done) {
+				if (poll(&pfd, 1, 100) > 0) {
+					rwx::set_interrupted(true);
+					break;
+				}
+			}
+		});
+
+		rwx::set_interrupted(false);
+		reset_getopt();
+		ret = run_main(argv.size() - 1, argv.data());
+
+		done = true;
+		watcher.join();
+	}
+
+	cout.flush();
+	cerr.flush();
+	fflush(stdout);
+	fflush(stderr);
+
+	for (int i = 0; i < 3; ++i) {
+		dup2(saved[i], i);
+		close(saved[i]);
+	}
+
+	// writing to the client's stdout may have failed
+	cout.clear();
+	cerr.clear();
+
+	if (cwd >= 0) {
+		if (fchdir(cwd) != 0) {
+			logger::w() << errno_error("fchdir").what() << endl;
+		}
+		close(cwd);
+	}
+
+	logger::loglevel(loglevel);
+	logger::no_stdout(false);
+	logger::set_logfile("");
+	profile::clear_opt_overrides();
+
+	char code = ret;
+	write_all(client, &code, 1);
+}
+
+int do_serve(int argc, char** argv)
+{
+	if (argc != 2) {
+		usage(false);
+		return 1;
+	}
+
+	if (serving) {
+		throw user_error("already running as a daemon");
+	}
+
+	sockaddr_un sa = make_sockaddr(argv[1]);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		throw errno_error("socket");
+	}
+
+	// commands are run with our privileges, so no one else may connect
+	mode_t mask = umask(077);
+	int ret = ::bind(fd, reinterpret_cast<sockaddr*>(&sa), sizeof(sa));
+
+	if (ret != 0 && errno == EADDRINUSE) {
+		// the socket may have been left behind by a daemon that has exited
+		int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+		bool alive = probe >= 0 && !connect(probe, reinterpret_cast<sockaddr*>(&sa), sizeof(sa));
+		close(probe);
+
+		if (alive) {
+			umask(mask);
+			throw user_error("daemon already running on "s + argv[1]);
+		}
+
+		unlink(argv[1]);
+		ret = ::bind(fd, reinterpret_cast<sockaddr*>(&sa), sizeof(sa));
+	}
+
+	umask(mask);
+
+	if (ret != 0 || listen(fd, 8) != 0) {
+		throw errno_error("bind: "s + argv[1]);
+	}
+
+	// a client may close its stdout while we're still writing to it
+	signal(SIGPIPE, SIG_IGN);
+	serving = true;
+
+	logger::i() << "listening on " << argv[1] << endl;
+
+	while (true) {
+		int client = accept(fd, nullptr, nullptr);
+		if (client < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			throw errno_error("accept");
+		}
+
+		handle_client(client);
+		close(client);
+	}
+}
+#endif
 }
 
 int do_main(int argc, char** argv)
 {
 	ios_base::sync_with_stdio();
+	int orig_argc = argc;
+	char** orig_argv = argv;
+	string daemon;
 	string profile;
+	string reference;
+	unsigned jobs = 1;
 	int loglevel = logger::info;
 	int opts = 0;
 	int opt;
@@ -545,7 +1273,9 @@ int do_main(int argc, char** argv)
 
 	opterr = 0;
 
-	while ((opt = getopt(argc, argv, "hsARFqvP:L:O:")) != -1) {
+	session_opts.clear();
+
+	while ((opt = getopt(argc, argv, "hsARSIFqvP:L:O:D:r:j:")) != -1) {
 		switch (opt) {
 		case 's':
 			opts |= opt_safe;
@@ -566,11 +1296,27 @@ int do_main(int argc, char** argv)
 		case 'R':
 			opts |= opt_resume;
 			break;
+		case 'S':
+			opts |= opt_sparse;
+			break;
+		case 'r':
+			reference = optarg;
+			break;
+		case 'I':
+			opts |= opt_incremental;
+			break;
+		case 'j':
+			jobs = lexical_cast<unsigned>(optarg);
+			break;
 		case 'P':
 			profile = optarg;
 			break;
 		case 'O':
 			profile::parse_opt_override(optarg);
+			session_opts += optarg + "\n"s;
+			break;
+		case 'D':
+			daemon = optarg;
 			break;
 		case 'L':
 			logger::set_logfile(optarg);
@@ -589,6 +1335,16 @@ int do_main(int argc, char** argv)
 		return 0;
 	}
 
+#ifndef _WIN32
+	if (!daemon.empty() && !serving && cmd != "serve") {
+		return do_client(daemon, orig_argc, orig_argv);
+	}
+#else
+	if (!daemon.empty()) {
+		throw user_error("daemon mode is not supported on this platform");
+	}
+#endif
+
 	logger::loglevel(loglevel);
 
 	argv += optind;
@@ -605,20 +1361,30 @@ int do_main(int argc, char** argv)
 	} else if (cmd == "run") {
 		return do_run(argc, argv, profile);
 	} else if (cmd == "dump") {
-		return do_dump(argc, argv, opts, profile);
+		return do_dump(argc, argv, opts, profile, reference, jobs);
+	} else if (cmd == "verify") {
+		return do_verify(argc, argv, opts, profile);
+	} else if (cmd == "hash") {
+		return do_hash(argc, argv, opts, profile);
 	} else if (cmd == "write" || cmd == "exec") {
 		return do_write_exec(argc, argv, opts, profile);
 	} else if (cmd == "scan") {
 		return do_scan(argc, argv, opts, profile);
 	} else if (cmd == "script") {
 		return do_script(argc, argv, opts, profile);
+#ifndef _WIN32
+	} else if (cmd == "serve") {
+		return do_serve(argc, argv);
+#endif
 	} else {
 		usage(false);
 		return 1;
 	}
 }
 
-int main(int argc, char** argv)
+namespace {
+// runs a command, as main() would
+int run_main(int argc, char** argv)
 {
 	try {
 		return do_main(argc, argv);
@@ -632,9 +1398,18 @@ int main(int argc, char** argv)
 		}
 	} catch (const user_error& e) {
 		handle_exception(e, false);
+		return 1;
 	} catch (const exception& e) {
 		handle_exception(e);
 	}
 
+	// the target may be in any state now, so don't reuse its session
+	sessions.clear();
 	return 1;
 }
+}
+
+int main(int argc, char** argv)
+{
+	return run_main(argc, argv);
+}
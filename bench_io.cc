@@ -0,0 +1,268 @@
+/**
+ * bcm2-utils
+ * Copyright (C) 2016 Joseph Lehner <joseph.c.lehner@gmail.com>
+ *
+ * bcm2-utils is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bcm2-utils is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with bcm2-utils.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <new>
+#include "util.h"
+#include "io.h"
+using namespace std;
+using namespace bcm2dump;
+
+namespace {
+unsigned long allocations = 0;
+}
+
+void* operator new(size_t size)
+{
+	++allocations;
+	if (void* p = malloc(size ? size : 1)) {
+		return p;
+	}
+
+	throw bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+	free(p);
+}
+
+namespace {
+
+// output of a 16 KiB BFC `/read_memory` chunk
+string make_chunk_text(uint32_t addr)
+{
+	string ret;
+	char line[128];
+
+	for (uint32_t i = 0; i < 0x4000; i += 16) {
+		snprintf(line, sizeof(line), "%08x: %08x  %08x  %08x  %08x  | ................\r\n",
+				addr + i, i, ~i, i * 3, i ^ 0x5a5a5a5a);
+		ret += line;
+	}
+
+	return ret;
+}
+
+uint16_t serve(const string& text, unsigned count, pid_t& pid)
+{
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) {
+		throw errno_error("socket");
+	}
+
+	sockaddr_in sa = {};
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t len = sizeof(sa);
+
+	if (::bind(fd, reinterpret_cast<sockaddr*>(&sa), len) || listen(fd, 1)
+			|| getsockname(fd, reinterpret_cast<sockaddr*>(&sa), &len)) {
+		throw errno_error("bind/listen");
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		throw errno_error("fork");
+	} else if (!pid) {
+		int client = accept(fd, nullptr, nullptr);
+		for (unsigned i = 0; client >= 0 && i < count; ++i) {
+			if (::write(client, text.data(), text.size()) != text.size()) {
+				break;
+			}
+		}
+		_exit(0);
+	}
+
+	close(fd);
+	return ntohs(sa.sin_port);
+}
+
+void run(size_t bufsize, unsigned chunks)
+{
+	string text = make_chunk_text(0x80000000);
+
+	pid_t pid;
+	uint16_t port = serve(text, chunks, pid);
+
+	io::recv_bufsize(bufsize);
+	auto conn = io::open_tcp("127.0.0.1", port);
+
+	unsigned long syscalls = io::recv_syscalls();
+	size_t bytes = 0;
+	mstimer t;
+
+	while (true) {
+		string line = conn->readln(1000);
+		if (line.empty()) {
+			break;
+		}
+
+		bytes += line.size() + 2;
+	}
+
+	auto elapsed = t.elapsed();
+	syscalls = io::recv_syscalls() - syscalls;
+	waitpid(pid, nullptr, 0);
+
+	double mib = bytes / (1024.0 * 1024.0);
+	printf("bufsize %5zu: %7.2f MiB text, %9lu syscalls, %10.0f syscalls/MiB, %6.2f MiB/s\n",
+			bufsize, mib, syscalls, syscalls / mib, elapsed ? (mib * 1000 / elapsed) : 0.0);
+}
+
+// heap allocations per line, when reading lines the old way (a new string
+// for each line, then trim()), vs. reusing one line buffer.
+void run_lines(const char* name, bool reuse, unsigned chunks)
+{
+	string text = make_chunk_text(0x80000000);
+
+	pid_t pid;
+	uint16_t port = serve(text, chunks, pid);
+
+	io::recv_bufsize(4096);
+	auto conn = io::open_tcp("127.0.0.1", port);
+
+	unsigned long lines = 0;
+	unsigned long allocs = allocations;
+	size_t bytes = 0;
+	string line;
+	mstimer t;
+
+	while (true) {
+		if (reuse) {
+			if (!conn->readln(line, 1000)) {
+				break;
+			}
+
+			trim_in_place(line);
+		} else {
+			line = conn->readln(1000);
+			if (line.empty()) {
+				break;
+			}
+
+			line = trim(line);
+		}
+
+		bytes += line.size() + 2;
+		++lines;
+	}
+
+	auto elapsed = t.elapsed();
+	allocs = allocations - allocs;
+	waitpid(pid, nullptr, 0);
+
+	double mib = bytes / (1024.0 * 1024.0);
+	printf("lines %-8s %7.2f MiB text, %9lu allocations, %6.2f allocations/line, %6.2f MiB/s\n",
+			name, mib, allocs, lines ? double(allocs) / lines : 0.0,
+			elapsed ? (mib * 1000 / elapsed) : 0.0);
+}
+
+// parses a line of `/read_memory` output, as bfc_ram does
+uint32_t decode_line(const string& line)
+{
+	const char* p = line.data();
+	const char* end = p + line.size();
+	uint32_t sum = 0, val;
+
+	size_t digits = parse_hex_u32(p, end, val);
+	if (!digits || p[digits] != ':') {
+		throw runtime_error("bad line: " + line);
+	}
+
+	for (p += digits + 1; (p = find_if(p, end, [] (char c) { return c != ' '; })) < end; p += digits) {
+		if (!(digits = parse_hex_u32(p, end, val))) {
+			break;
+		}
+
+		sum += val;
+	}
+
+	return sum;
+}
+
+uint32_t decode_line_sscanf(const string& line)
+{
+	uint32_t off, data[4];
+	if (sscanf(line.c_str(), "%x: %x  %x  %x  %x", &off, &data[0], &data[1], &data[2], &data[3]) != 5) {
+		throw runtime_error("bad line: " + line);
+	}
+
+	return data[0] + data[1] + data[2] + data[3];
+}
+
+void run_decode(const char* name, uint32_t (*decode)(const string&), unsigned chunks)
+{
+	auto lines = split(make_chunk_text(0x80000000), '\n', false);
+	for (auto& line : lines) {
+		line = trim(line);
+	}
+
+	size_t bytes = 0;
+	uint32_t sum = 0;
+	mstimer t;
+
+	for (unsigned i = 0; i < chunks; ++i) {
+		for (const auto& line : lines) {
+			sum += decode(line);
+			bytes += line.size() + 2;
+		}
+	}
+
+	auto elapsed = t.elapsed();
+	double mib = bytes / (1024.0 * 1024.0);
+	printf("decode %-7s %7.2f MiB text, %8.2f MiB/s (%08x)\n", name, mib,
+			elapsed ? (mib * 1000 / elapsed) : 0.0, sum);
+}
+}
+
+int main(int argc, char** argv)
+{
+	try {
+		unsigned chunks = argc > 1 ? lexical_cast<unsigned>(argv[1]) : 64;
+
+		// a receive buffer of 1 byte mimics the old, unbuffered
+		// code path (one select() and one recv() per byte).
+		run(1, chunks);
+		run(4096, chunks);
+
+		// allocations per line (a 16 KiB chunk is 1024 lines)
+		run_lines("readln", false, chunks);
+		run_lines("reuse", true, chunks);
+
+		// decoding speed of the hex dump text itself
+		run_decode("sscanf", &decode_line_sscanf, chunks * 16);
+		run_decode("hex", &decode_line, chunks * 16);
+	} catch (const exception& e) {
+		cerr << "error: " << e.what() << endl;
+		return 1;
+	}
+
+	return 0;
+}
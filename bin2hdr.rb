@@ -27,7 +27,13 @@ puts " */"
 arch = "mips"
 tmp = "tmp.bin"
 
-[ "read", "write" ].each do |func|
+# record which bcm2_*_args flags are supported by this code
+features = `echo BCM2_RWCODE_FEATURES | #{ARGV[0]}cpp -P -include rwcode2.h -`
+raise "failed to determine rwcode features" if !$?.success?
+puts
+puts "#define BCM2_RWCODE_INC_FEATURES #{features.lines.last.strip}"
+
+[ "read", "write", "load" ].each do |func|
 	func = "#{arch}_#{func}"
 	system("#{ARGV[0]}objcopy -j .text.#{func} -O binary #{ARGV[1]} #{tmp}")
 	puts
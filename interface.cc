@@ -19,8 +19,12 @@
 
 #include <sys/stat.h>
 #include <algorithm>
+#include <fstream>
 #include <unistd.h>
+#include <map>
+#include <mutex>
 #include <set>
+#include <vector>
 #include "interface.h"
 #include "rwx.h"
 
@@ -62,6 +66,14 @@ bool is_bfc_prompt(const string& str)
 	return is_bfc_prompt_privileged(str) || is_bfc_prompt_unprivileged(str);
 }
 
+// the prompt must be the last thing on the line, so that a partial
+// line containing the echo of a command isn't mistaken for one.
+bool ends_with_chevron(const string& str)
+{
+	auto i = str.find_last_not_of(' ');
+	return i != string::npos && str[i] == '>';
+}
+
 bool is_bfc_login_prompt(const string& line)
 {
 	return contains(line, "Login:") || contains(line, "login:")
@@ -88,7 +100,7 @@ uint32_t get_max_magic_addr(const profile::sp& p, int intf_id)
 {
 	uint32_t ret = 0;
 
-	for (auto v : p->versions()) {
+	for (const auto& v : p->versions()) {
 		if (v.intf() == intf_id) {
 			ret = max(ret, v.magic()->addr + magic_size(v.magic()) - 1);
 		}
@@ -106,7 +118,7 @@ set<string> get_all_su_passwords()
 	set<string> ret;
 
 	for (auto p : profile::list()) {
-		for (auto v : p->versions()) {
+		for (const auto& v : p->versions()) {
 			if (v.has_opt("bfc:su_password")) {
 				ret.insert(v.get_opt_str("bfc:su_password"));
 			}
@@ -146,6 +158,9 @@ class bfc : public cmdline_interface
 	virtual bool is_crash_line(const string& line) const override;
 	virtual bool check_for_prompt(const string& line) const override;
 
+	virtual bool is_prompt(const string& line) const override
+	{ return ends_with_chevron(line) && is_bfc_prompt(line); }
+
 	private:
 	void do_elevate_privileges();
 	bool m_privileged = false;
@@ -413,6 +428,9 @@ class bootloader_bolt : public cmdline_interface
 	protected:
 	bool is_crash_line(const string& line) const override;
 	bool check_for_prompt(const string& line) const override;
+
+	bool is_prompt(const string& line) const override
+	{ return ends_with_chevron(line) && check_for_prompt(line); }
 };
 
 bool bootloader_bolt::is_ready(bool passive)
@@ -588,46 +606,130 @@ void bfc_telnet::elevate_privileges()
 	bfc::elevate_privileges();
 }
 
-sp<cmdline_interface> do_detect_interface(const io::sp &io)
+sp<cmdline_interface> do_detect_interface(const io::sp &io, const string& hint)
 {
-	sp<cmdline_interface> intf = make_shared<bfc_telnet>();
-	if (intf->is_active(io)) {
-		return intf;
-	}
+	vector<sp<cmdline_interface>> intfs = {
+		make_shared<bfc_telnet>(),
+		make_shared<bootloader_cm1>(),
+		make_shared<bootloader_bolt>(),
+		make_shared<bfc>(),
+	};
 
-	intf = make_shared<bootloader_cm1>();
-	if (intf->is_active(io)) {
-		return intf;
-	}
+	// try the interface that was detected last time first, to avoid
+	// waiting for the others to time out. bfc_telnet is skipped, since
+	// it's always tried first anyway, and shares its name with bfc.
+	auto it = find_if(intfs.begin() + 1, intfs.end(), [&hint] (const sp<cmdline_interface>& intf) {
+		return intf->name() == hint;
+	});
+
+	if (it != intfs.end()) {
+		// when probing in the regular order, the device has had plenty of
+		// time to respond by the time the later interfaces are tried, so
+		// give it a second chance.
+		for (unsigned i = 0; i < 2; ++i) {
+			if ((*it)->is_active(io)) {
+				return *it;
+			}
+		}
 
-	intf = make_shared<bootloader_bolt>();
-	if (intf->is_active(io)) {
-		return intf;
+		intfs.erase(it);
 	}
 
-	intf = make_shared<bfc>();
-	if (intf->is_active(io)) {
-		return intf;
+	for (auto intf : intfs) {
+		if (intf->is_active(io)) {
+			return intf;
+		}
 	}
 
 	throw runtime_error("interface auto-detection failed");
 }
 
-sp<cmdline_interface> detect_interface(const io::sp &io)
+sp<cmdline_interface> detect_interface(const io::sp &io, const string& hint = "")
 {
-	auto intf = do_detect_interface(io);
+	auto intf = do_detect_interface(io, hint);
 	logger::d() << "detected interface: " << intf->name() << endl;
 	return intf;
 }
+// reads magic values from ram, merging nearby magics into a single read.
+// reading a few bytes in between is much cheaper than another round trip.
+class magic_reader
+{
+	public:
+	magic_reader(const rwx::sp& ram)
+	: m_ram(ram)
+	{}
+
+	void add(const bcm2_magic* m)
+	{
+		m_ranges.emplace_back(m->addr, m->addr + magic_size(m));
+		m_merged = false;
+	}
+
+	// reads the data at the magic's location, but nothing at or above
+	// `limit`, unless the magic itself extends that far.
+	string read(const bcm2_magic* m, uint32_t limit)
+	{
+		uint32_t addr = m->addr;
+		uint32_t size = magic_size(m);
+
+		merge();
+
+		auto r = prev(upper_bound(m_ranges.begin(), m_ranges.end(), make_pair(addr, UINT32_MAX)));
+		uint32_t end = max(min(r->second, limit), addr + size);
+
+		// if a previous read stopped short of this magic, read the rest
+		string& data = m_data[r->first];
+		uint32_t have = r->first + data.size();
+		if (have < end) {
+			data += m_ram->read(have, end - have);
+		}
+
+		return data.substr(addr - r->first, size);
+	}
+
+	private:
+	static constexpr uint32_t max_gap = 256;
+
+	void merge()
+	{
+		if (m_merged) {
+			return;
+		}
+
+		sort(m_ranges.begin(), m_ranges.end());
+
+		vector<pair<uint32_t, uint32_t>> merged;
+
+		for (const auto& r : m_ranges) {
+			if (!merged.empty() && r.first <= merged.back().second + max_gap) {
+				merged.back().second = max(merged.back().second, r.second);
+			} else {
+				merged.push_back(r);
+			}
+		}
+
+		m_ranges = move(merged);
+		m_merged = true;
+	}
+
+	rwx::sp m_ram;
+	// [begin, end) of all magics
+	vector<pair<uint32_t, uint32_t>> m_ranges;
+	bool m_merged = false;
+	// data read so far, by range
+	map<uint32_t, string> m_data;
+};
 
+constexpr uint32_t magic_reader::max_gap;
 
-void detect_profile_from_magics(const interface::sp& intf, const profile::sp& profile)
+// returns the magic that identified the profile
+const bcm2_magic* detect_profile_from_magics(const interface::sp& intf, const profile::sp& profile)
 {
 	if (profile) {
 		// TODO allow manually specifying a version, auto-detect otherwise
 		auto v = profile->default_version(intf->id());
 		intf->set_profile(profile, v);
-		return;
+		return nullptr;
 	}
 
 	rwx::sp ram = rwx::create(intf, "ram", true);
@@ -670,6 +772,7 @@ void detect_profile_from_magics(const interface::sp& intf, const profile::sp& pr
 	};
 
 	set<helper, comp> magics;
+	magic_reader reader(ram);
 
 	for (auto p : profile::list()) {
 		if (profile && profile->name() != p->name()) {
@@ -678,20 +781,23 @@ void detect_profile_from_magics(const interface::sp& intf, const profile::sp& pr
 
 		uint32_t x = get_max_magic_addr(p, intf->id());
 
-		for (auto v : p->versions()) {
+		for (const auto& v : p->versions()) {
 			if (v.intf() == intf->id()) {
 				magics.insert({ v.magic(), p, v, x });
+				reader.add(v.magic());
 			}
 		}
 
 		for (auto m : p->magics()) {
 			magics.insert({ m, p, version(), x });
+			reader.add(m);
 		}
 	}
 
 	for (const helper& h : magics) {
-		string data = magic_data(h.m);
-		if (ram->read(h.m->addr, data.size()) == data) {
+		// since magics are tried in ascending order of the profile's
+		// highest magic address, reading up to that address is safe.
+		if (reader.read(h.m, h.x + 1) == magic_data(h.m)) {
 			version v = h.v;
 
 			if (v.name().empty()) {
@@ -699,9 +805,151 @@ void detect_profile_from_magics(const interface::sp& intf, const profile::sp& pr
 			}
 
 			intf->set_profile(h.p, v);
-			return;
+			return h.m;
+		}
+	}
+
+	return nullptr;
+}
+
+// the results of interface and profile detection are stored in the cache
+// directory, one line ("<key>\t<interface>\t<profile>\t<version>\t<magic>")
+// per connection. <magic> is the address of the magic that identified the
+// profile, or 0 if it was detected by other means.
+struct fingerprint
+{
+	string intf;
+	string profile;
+	string version;
+	uint32_t magic = 0;
+};
+
+mutex fingerprint_mutex;
+
+map<string, fingerprint> read_fingerprints(const string& filename)
+{
+	map<string, fingerprint> ret;
+	ifstream in(filename);
+	string line;
+
+	while (getline(in, line)) {
+		auto tokens = split(line, '\t', true);
+		if (tokens.size() != 5) {
+			continue;
+		}
+
+		fingerprint& fp = ret[tokens[0]];
+		fp.intf = tokens[1];
+		fp.profile = tokens[2];
+		fp.version = tokens[3];
+		fp.magic = strtoul(tokens[4].c_str(), nullptr, 16);
+	}
+
+	return ret;
+}
+
+bool load_fingerprint(const string& key, fingerprint& fp)
+{
+	lock_guard<mutex> lock(fingerprint_mutex);
+	string filename = cache_filename("devices");
+	if (key.empty() || filename.empty()) {
+		return false;
+	}
+
+	auto fps = read_fingerprints(filename);
+	auto it = fps.find(key);
+	if (it == fps.end()) {
+		return false;
+	}
+
+	fp = it->second;
+	return true;
+}
+
+void save_fingerprint(const string& key, const fingerprint& fp)
+{
+	lock_guard<mutex> lock(fingerprint_mutex);
+	string filename = cache_filename("devices");
+	if (key.empty() || filename.empty()) {
+		return;
+	}
+
+	auto fps = read_fingerprints(filename);
+	fps[key] = fp;
+
+	ofstream out(filename, ios::trunc);
+	for (const auto& p : fps) {
+		out << p.first << "\t" << p.second.intf << "\t" << p.second.profile << "\t"
+			<< p.second.version << "\t" << to_hex(p.second.magic) << endl;
+	}
+
+	if (!out) {
+		logger::d() << "failed to write " << filename << endl;
+	}
+}
+
+// confirms a cached profile by reading its magic, which is much faster
+// than trying all known magics. returns the magic on success. the cache
+// may be stale (another device on the same port) or edited, so the magic
+// is only read if it's valid for the detected interface.
+const bcm2_magic* detect_profile_from_fingerprint(const interface::sp& intf, const fingerprint& fp)
+{
+	if (fp.intf != intf->name() || fp.profile.empty() || !fp.magic) {
+		return nullptr;
+	}
+
+	profile::sp p;
+
+	try {
+		p = profile::get(fp.profile);
+	} catch (const exception& e) {
+		return nullptr;
+	}
+
+	version v = p->default_version(intf->id());
+	const bcm2_magic* m = nullptr;
+	bool found = fp.version.empty();
+
+	for (const auto& ver : p->versions()) {
+		if (ver.intf() == intf->id() && ver.name() == fp.version) {
+			v = ver;
+			found = true;
+			if (ver.magic()->addr == fp.magic) {
+				m = ver.magic();
+			}
+			break;
+		}
+	}
+
+	if (!found) {
+		logger::d() << "cached version " << fp.version << " of " << p->name()
+				<< " is not a " << intf->name() << " version" << endl;
+		return nullptr;
+	}
+
+	for (auto pm : p->magics()) {
+		if (!m && pm->addr == fp.magic) {
+			m = pm;
 		}
 	}
+
+	if (!m) {
+		return nullptr;
+	} else if (!p->ram().check_range(m->addr, magic_size(m), false)) {
+		// reading outside the ram might crash the device
+		logger::d() << "cached magic 0x" << to_hex(m->addr) << " is outside the ram of "
+				<< p->name() << endl;
+		return nullptr;
+	}
+
+	rwx::sp ram = rwx::create(intf, "ram", true);
+	if (ram->read(m->addr, magic_size(m)) != magic_data(m)) {
+		logger::d() << "cached profile " << p->name() << " doesn't match" << endl;
+		return nullptr;
+	}
+
+	intf->set_profile(p, v);
+	return m;
 }
 }
 
@@ -722,6 +970,13 @@ bool cmdline_interface::wait_quiet(unsigned timeout) const
 	return true;
 }
 
+bool cmdline_interface::wait_prompt(unsigned timeout) const
+{
+	return foreach_line_view([this] (boost::string_view line) {
+		return is_prompt(line.to_string());
+	}, timeout, true);
+}
+
 bool cmdline_interface::run(const string& cmd, const string& expect, bool stop_on_match)
 {
 	call(cmd);
@@ -767,34 +1022,40 @@ vector<string> cmdline_interface::run_raw(const string& cmd, unsigned timeout)
 	return lines;
 }
 
-bool cmdline_interface::foreach_line_raw(function<bool(const string&)> f, unsigned timeout, bool restart) const
+void cmdline_interface::writeln_windowed(const vector<string>& lines, size_t window,
+		function<bool(const string&, size_t)> ack, unsigned timeout)
 {
-	mstimer t;
+	window = max(window, size_t(1));
+	size_t acked = 0;
+	string line;
 
-	while (true) {
-		string line;
-		if (timeout) {
-			auto remaining = timeout - t.elapsed();
-			if (remaining < 0) {
-				break;
+	for (size_t i = 0; i < lines.size(); ++i) {
+		writeln_nowait(lines[i]);
+
+		while (acked <= i && ((i + 1 - acked) >= window || (i + 1) == lines.size())) {
+			if (!readln(line, timeout)) {
+				throw runtime_error("timeout while waiting for acknowledgement of line " + to_string(acked));
 			}
 
-			line = readln(remaining);
-		} else {
-			line = readln();
-		}
+			trim_in_place(line);
 
-		if (line.empty()) {
-			break;
-		} else if (f(line)) {
-			if (restart) {
-				t.reset();
+			if (line.empty() || !line[0]) {
+				continue;
+			} else if (find(lines.begin() + acked, lines.begin() + i + 1, line) != lines.begin() + i + 1) {
+				// echo of a line in flight
+				continue;
+			} else if (ack(line, acked)) {
+				++acked;
 			}
-			return true;
 		}
 	}
+}
 
-	return false;
+bool cmdline_interface::foreach_line_raw(function<bool(const string&)> f, unsigned timeout, bool restart) const
+{
+	return foreach_line_view([&f] (boost::string_view line) {
+		return f(line.to_string());
+	}, timeout, restart);
 }
 
 bool cmdline_interface::foreach_line(function<bool(const string&)> f, unsigned timeout) const
@@ -817,7 +1078,16 @@ bool cmdline_interface::foreach_line(function<bool(const string&)> f, unsigned t
 
 string cmdline_interface::readln(unsigned timeout) const
 {
-	string line = m_io->readln(timeout ? timeout : this->timeout());
+	string line;
+	readln(line, timeout);
+	return line;
+}
+
+bool cmdline_interface::readln(string& line, unsigned timeout) const
+{
+	if (!m_io->readln(line, timeout ? timeout : this->timeout())) {
+		return false;
+	}
 
 	if (is_crash_line(line)) {
 		// consume lines to fill the io log
@@ -826,15 +1096,22 @@ string cmdline_interface::readln(unsigned timeout) const
 		throw runtime_error("target has crashed");
 	}
 
-	return line;
+	return true;
 }
 
-void interface::initialize(const profile::sp& profile)
+void interface::initialize(const profile::sp& profile, const string& key)
 {
 	m_profile = profile;
 
+	fingerprint fp;
+	const bcm2_magic* magic = nullptr;
+
+	if (!m_profile && load_fingerprint(key, fp)) {
+		magic = detect_profile_from_fingerprint(shared_from_this(), fp);
+	}
+
 	if (!m_profile) {
-		detect_profile_from_magics(shared_from_this(), m_profile);
+		magic = detect_profile_from_magics(shared_from_this(), m_profile);
 	}
 
 	elevate_privileges();
@@ -843,6 +1120,19 @@ void interface::initialize(const profile::sp& profile)
 		detect_profile();
 	}
 
+	if (!profile && m_profile) {
+		fingerprint detected;
+		detected.intf = name();
+		detected.profile = m_profile->name();
+		detected.version = m_version.name();
+		detected.magic = magic ? magic->addr : 0;
+
+		if (detected.intf != fp.intf || detected.profile != fp.profile
+				|| detected.version != fp.version || detected.magic != fp.magic) {
+			save_fingerprint(key, detected);
+		}
+	}
+
 	if (!m_profile) {
 		logger::i() << "profile auto-detection failed" << endl;
 	} else {
@@ -855,25 +1145,27 @@ void interface::initialize(const profile::sp& profile)
 		logger::i() << endl;
 	}
 
+	m_resolved = resolved_version(m_version);
+
 	initialize_impl();
 }
 
-interface::sp interface::detect(const io::sp& io, const profile::sp& profile)
+interface::sp interface::detect(const io::sp& io, const profile::sp& profile, const string& key)
 {
-	interface::sp intf = detect_interface(io);
-	intf->initialize(profile);
+	fingerprint fp;
+	load_fingerprint(key, fp);
+
+	interface::sp intf = detect_interface(io, fp.intf);
+	intf->initialize(profile, key);
 	return intf;
 }
 
-interface::sp interface::create(const string& spec, const string& profile_name)
+namespace {
+// splits `spec` into its arguments, and returns its type
+string parse_spec(const string& spec, vector<string>& tokens)
 {
-	profile::sp profile;
-	if (!profile_name.empty()) {
-		profile = profile::get(profile_name);
-	}
-
 	string type;
-	vector<string> tokens = split(spec, ':', false, 2);
+	tokens = split(spec, ':', false, 2);
 	if (tokens.size() == 2) {
 		type = tokens[0];
 		tokens.erase(tokens.begin());
@@ -893,14 +1185,40 @@ interface::sp interface::create(const string& spec, const string& profile_name)
 		}
 	}
 
+	return type;
+}
+}
+
+string interface::spec_type(const string& spec)
+{
+	vector<string> tokens;
+	return parse_spec(spec, tokens);
+}
+
+interface::sp interface::create(const string& spec, const string& profile_name)
+{
+	profile::sp profile;
+	if (!profile_name.empty()) {
+		profile = profile::get(profile_name);
+	}
+
+	vector<string> tokens;
+	string type = parse_spec(spec, tokens);
+
+	// identifies the device in the fingerprint cache. the password is
+	// deliberately left out.
+	string key = type + ":" + tokens[0];
+
 	try {
 		if (type == "serial") {
 			unsigned speed = tokens.size() == 2 ? lexical_cast<unsigned>(tokens[1]) : 115200;
-			return detect(io::open_serial(tokens[0].c_str(), speed), profile);
+			return detect(io::open_serial(tokens[0].c_str(), speed), profile, key);
 		} else if (type == "tcp") {
-			return detect(io::open_tcp(tokens[0], lexical_cast<uint16_t>(tokens[1])), profile);
+			key += "," + tokens[1];
+			return detect(io::open_tcp(tokens[0], lexical_cast<uint16_t>(tokens[1])), profile, key);
 		} else if (type == "telnet") {
 			uint16_t port = tokens.size() == 4 ? lexical_cast<uint16_t>(tokens[3]) : 23;
+			key += "," + to_string(port) + "," + tokens[1];
 			interface::sp intf = detect_interface(io::open_telnet(tokens[0], port));
 
 			// this is UGLY, but it should never fail
@@ -913,7 +1231,7 @@ interface::sp interface::create(const string& spec, const string& profile_name)
 				logger::w() << "detected non-telnet interface" << endl;
 			}
 
-			intf->initialize(profile);
+			intf->initialize(profile, key);
 			return intf;
 		} else if (type == "snmp") {
 #ifdef BCM2DUMP_WITH_SNMP
@@ -19,6 +19,7 @@
 
 #ifndef BCM2DUMP_INTERFACE_H
 #define BCM2DUMP_INTERFACE_H
+#include <boost/utility/string_view.hpp>
 #include <functional>
 #include <csignal>
 #include <memory>
@@ -48,6 +49,7 @@ class interface : public std::enable_shared_from_this<interface>
 	{
 		set_profile(profile);
 		m_version = version;
+		m_resolved = resolved_version(m_version);
 	}
 
 	virtual void set_profile(const profile::sp& profile)
@@ -62,18 +64,26 @@ class interface : public std::enable_shared_from_this<interface>
 	virtual bool has_version() const
 	{ return !m_version.name().empty(); }
 
+	// the version's codecfg and options, for use in hot code
+	const resolved_version& resolved() const
+	{ return m_resolved; }
+
 	virtual bool is_privileged() const
 	{ return true; }
 
 	virtual void elevate_privileges() {}
 
-	static interface::sp detect(const io::sp& io, const profile::sp& sp = nullptr);
+	// `key` identifies the device in the fingerprint cache, if not empty
+	static interface::sp detect(const io::sp& io, const profile::sp& sp = nullptr,
+			const std::string& key = "");
 	static interface::sp create(const std::string& specl, const std::string& profile = "");
+	// returns the connection type of `spec` (serial, tcp or telnet)
+	static std::string spec_type(const std::string& spec);
 
 	virtual bcm2_interface id() const = 0;
 
 	protected:
-	void initialize(const profile::sp& profile);
+	void initialize(const profile::sp& profile, const std::string& key = "");
 
 	virtual void initialize_impl()
 	{}
@@ -87,11 +97,19 @@ class interface : public std::enable_shared_from_this<interface>
 	protected:
 	profile::sp m_profile;
 	version_type m_version;
+	resolved_version m_resolved;
 };
 
 class cmdline_interface : public interface
 {
 	public:
+	virtual ~cmdline_interface()
+	{
+		if (m_io) {
+			m_io->set_prompt_check(nullptr);
+		}
+	}
+
 	std::vector<std::string> run(const std::string& cmd, unsigned timeout = 0);
 	std::vector<std::string> run_raw(const std::string& cmd, unsigned timeout = 0);
 	bool run(const std::string& cmd, const std::string& expect, bool stop_on_match = false);
@@ -99,6 +117,9 @@ class cmdline_interface : public interface
 	virtual bool is_ready(bool passive = false) = 0;
 	virtual bool wait_ready(unsigned timeout = 5000);
 	virtual bool wait_quiet(unsigned timeout = 500) const;
+	// consumes lines until a prompt is read, or until no more lines are
+	// received within `timeout` milliseconds.
+	bool wait_prompt(unsigned timeout) const;
 
 	virtual bool is_active()
 	{ return is_ready(false); }
@@ -111,6 +132,10 @@ class cmdline_interface : public interface
 			return false;
 		}
 
+		m_io->set_prompt_check([this] (const std::string& line) {
+			return is_prompt(line);
+		});
+
 		return true;
 	}
 
@@ -120,10 +145,53 @@ class cmdline_interface : public interface
 	virtual void write(const std::string& str)
 	{ m_io->write(str); }
 
+	// writes a line without consuming its echo
+	virtual void writeln_nowait(const std::string& str)
+	{ m_io->writeln_nowait(str); }
+
+	// writes `lines`, with up to `window` of them awaiting acknowledgement.
+	// received lines are passed to `ack`, along with the index of the oldest
+	// unacknowledged line, except for echoes of unacknowledged lines. `ack`
+	// returns true if the line acknowledges that line, or false to ignore it.
+	// lines are written without consuming their echo, since with more than
+	// one line in flight, the next line received may be an acknowledgement.
+	void writeln_windowed(const std::vector<std::string>& lines, size_t window,
+			std::function<bool(const std::string&, size_t)> ack, unsigned timeout = 0);
+
 	bool foreach_line_raw(std::function<bool(const std::string&)> f, unsigned timeout = 0, bool restart = false) const;
 	bool foreach_line(std::function<bool(const std::string&)> f, unsigned timeout = 0) const;
 
+	// like foreach_line_raw(), but `f` is passed a view of the line, which is
+	// only valid until `f` returns. the line buffer is reused, so this doesn't
+	// allocate memory for each line.
+	template<class F> bool foreach_line_view(F f, unsigned timeout = 0, bool restart = false) const
+	{
+		mstimer t;
+		std::string line;
+
+		while (true) {
+			if (timeout) {
+				auto remaining = timeout - t.elapsed();
+				if (remaining < 0 || !readln(line, remaining)) {
+					break;
+				}
+			} else if (!readln(line)) {
+				break;
+			}
+
+			if (f(boost::string_view(line))) {
+				if (restart) {
+					t.reset();
+				}
+				return true;
+			}
+		}
+
+		return false;
+	}
+
 	virtual std::string readln(unsigned timeout = 0) const;
+	bool readln(std::string& line, unsigned timeout = 0) const;
 
 	virtual bool pending(unsigned timeout = 0) const
 	{ return m_io->pending(timeout ? timeout : this->timeout()); }
@@ -137,6 +205,11 @@ class cmdline_interface : public interface
 
 	virtual bool check_for_prompt(const std::string& line) const = 0;
 
+	// returns true if `line` is nothing but a prompt. unlike
+	// check_for_prompt(), this must not read any more lines.
+	virtual bool is_prompt(const std::string& line) const
+	{ return false; }
+
 	virtual uint32_t timeout() const
 	{ return 50; }
 
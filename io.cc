@@ -18,6 +18,8 @@
  */
 
 #include <system_error>
+#include <algorithm>
+#include <bitset>
 #include <sys/types.h>
 #include <stdexcept>
 #include <fcntl.h>
@@ -87,8 +89,12 @@ class scoped_nonblock
 
 ssize_t recv_dontwait(int fd, char* buf, size_t len, int flags = 0)
 {
+#ifndef _WIN32
+	return recv(fd, buf, len, flags | MSG_DONTWAIT);
+#else
 	scoped_nonblock f(fd);
 	return recv(fd, buf, len, flags);
+#endif
 }
 
 ssize_t send_nosignal(int fd, const char* buf, size_t len, int flags = 0)
@@ -208,9 +214,18 @@ class fdio : public io
 
 	protected:
 	virtual int getc() override;
-	virtual ssize_t read1(char &c);
+	// reads at most `len` bytes that are already available
+	virtual ssize_t read_some(char* buf, size_t len);
+	// moves up to `length` bytes from the receive buffer to `buf`
+	size_t read_buffered(string& buf, size_t length);
 
 	int m_fd;
+
+	private:
+	bool fill_rbuf();
+
+	string m_rbuf;
+	size_t m_rpos = 0;
 };
 
 #if defined(_WIN32)
@@ -262,38 +277,57 @@ class tcp : public fdio
 	virtual string read(size_t length, bool partial = true) override;
 
 	protected:
-	virtual ssize_t read1(char& c) override;
+	virtual ssize_t read_some(char* buf, size_t len) override;
 };
 
 class telnet : public tcp
 {
 	public:
-	telnet(const string& addr, uint16_t port) : tcp(addr, port) {}
+	telnet(const string& addr, uint16_t port);
 	virtual void write(const string& str) override;
 	virtual void writeln(const string& str) override;
+	virtual void writeln_nowait(const string& str) override
+	{ write(str + "\r"); }
 
 	protected:
 	virtual int getc() override;
 
 	private:
+	bool accept_opt(int opt) const;
 	void handle_op_opt(int op, int opt);
 	void send_op_opt(int op, int opt);
+	void request_opt(int opt, bool local);
 
-#if 0
 	static int constexpr opt_binary = 0;
 	static int constexpr opt_echo = 1;
-	static int constexpr opt_suppres_ga = 3;
-	static int constexpr opt_remote_flow_ctrl = 33;
+	static int constexpr opt_suppress_ga = 3;
 
-	static int constexpr op_do = 252;
-	static int constexpr op_wont = 253;
-#endif
+	static int constexpr cmd_se = 240;
+	static int constexpr cmd_sb = 250;
 	static int constexpr op_will = 251;
+	static int constexpr op_wont = 252;
+	static int constexpr op_do = 253;
 	static int constexpr op_dont = 254;
+	static int constexpr cmd_iac = 255;
+
+	// options that are enabled on our side, and on the server's side
+	bitset<256> m_local;
+	bitset<256> m_remote;
+	// options for which we've sent a request, but haven't seen a reply
+	bitset<256> m_local_pending;
+	bitset<256> m_remote_pending;
+	// the server echoes everything we send, until it confirms that it won't
+	bool m_echo = true;
 };
 
 bool fdio::pending(unsigned timeout)
 {
+	if (m_rpos < m_rbuf.size()) {
+		return true;
+	}
+
+	++s_recv_syscalls;
+
 	fd_set fds;
 	FD_ZERO(&fds);
 	FD_SET(m_fd, &fds);
@@ -318,31 +352,62 @@ bool fdio::pending(unsigned timeout)
 
 int fdio::getc()
 {
-	char c;
-	ssize_t ret = read1(c);
-	if (ret == 1) {
-		return c & 0xff;
-	} else if (!ret || errno == EWOULDBLOCK || errno == EAGAIN) {
+	if (m_rpos == m_rbuf.size() && !fill_rbuf()) {
 		return eof;
+	}
+
+	return m_rbuf[m_rpos++] & 0xff;
+}
+
+bool fdio::fill_rbuf()
+{
+	m_rbuf.resize(s_recv_bufsize);
+	m_rpos = 0;
+
+	++s_recv_syscalls;
+	ssize_t ret = read_some(&m_rbuf[0], m_rbuf.size());
+	if (ret > 0) {
+		m_rbuf.resize(ret);
+		return true;
+	}
+
+	m_rbuf.clear();
+
+	if (!ret || errno == EWOULDBLOCK || errno == EAGAIN) {
+		return false;
 	} else {
-		throw errno_error("read1");
+		throw errno_error("read_some");
 	}
 }
 
-ssize_t fdio::read1(char& c)
+ssize_t fdio::read_some(char* buf, size_t len)
 {
-	return ::read(m_fd, &c, 1);
+	return ::read(m_fd, buf, len);
+}
+
+size_t fdio::read_buffered(string& buf, size_t length)
+{
+	size_t n = min(length, m_rbuf.size() - m_rpos);
+	buf.assign(m_rbuf, m_rpos, n);
+	m_rpos += n;
+	return n;
 }
 
 string fdio::read(size_t length, bool all)
 {
-	string buf(length, '\0');
-	ssize_t read = ::read(m_fd, &buf[0], length);
-	if (read < 0 || (all && read < length)) {
+	string buf;
+	size_t n = read_buffered(buf, length);
+	if (n == length) {
+		return buf;
+	}
+
+	buf.resize(length);
+	ssize_t read = ::read(m_fd, &buf[n], length - n);
+	if (read < 0 || (all && (n + read) < length)) {
 		throw errno_error("read");
 	}
 
-	buf.resize(read);
+	buf.resize(n + read);
 	return buf;
 }
 
@@ -369,8 +434,7 @@ void serial::write(const string& str)
 void serial::writeln(const string& str)
 {
 	write(str + "\r\n");
-	// consume the line we've just written
-	readln(100);
+	consume_echo(100);
 }
 
 #ifdef _WIN32
@@ -584,80 +648,94 @@ void tcp::write(const string& str)
 	#endif
 }
 
-ssize_t tcp::read1(char& c)
+ssize_t tcp::read_some(char* buf, size_t len)
 {
-	return recv_dontwait(m_fd, &c, 1);
+	return recv_dontwait(m_fd, buf, len);
 }
 
 string tcp::read(size_t length, bool all)
 {
-	string buf(length, '\0');
-	ssize_t read = recv(m_fd, &buf[0], length, MSG_DONTWAIT);
-	if (read < 0 || (all && read < length)) {
+	string buf;
+	size_t n = read_buffered(buf, length);
+	if (n == length) {
+		return buf;
+	}
+
+	buf.resize(length);
+	ssize_t read = recv_dontwait(m_fd, &buf[n], length - n);
+	if (read < 0 || (all && (n + read) < length)) {
 		throw errno_error("read");
 	}
 
-	buf.resize(read);
+	buf.resize(n + read);
 	return buf;
 }
 
+telnet::telnet(const string& addr, uint16_t port)
+: tcp(addr, port)
+{
+	request_opt(opt_binary, true);
+	request_opt(opt_binary, false);
+}
+
 void telnet::write(const string& str)
 {
-	string::size_type i = str.find_first_of("\xff\r");
-	if (i != string::npos) {
-		string modstr = str;
-		do {
-			if (str[i] == '\xff') {
-				modstr.insert(i, 1, '\xff');
-				i += 2;
-			} else if (str[i] == '\r') {
-				if ((i + 1) < str.size()) {
-					if (str[i + 1] != '\n') {
-						modstr.insert(i + 1, 1, '\0');
-						i += 2;
-					}
-				} else {
-					modstr += '\0';
-					i += 1;
-				}
-			}
+	// unless we're in binary mode, a CR that isn't part of a CRLF
+	// must be followed by a NUL
+	bool binary = m_local[opt_binary];
+	string buf;
+	buf.reserve(str.size() + 1);
 
-			i = modstr.find_first_of("\xff\r", i + 1);
-		} while (i != string::npos);
+	for (size_t i = 0; i < str.size(); ++i) {
+		buf += str[i];
 
-		tcp::write(modstr);
-	} else {
-		tcp::write(str);
+		if (str[i] == '\xff') {
+			buf += '\xff';
+		} else if (str[i] == '\r' && !binary && (i + 1 == str.size() || str[i + 1] != '\n')) {
+			buf += '\0';
+		}
 	}
+
+	tcp::write(buf);
 }
 
 void telnet::writeln(const string& str)
 {
-	write(str + "\r");
-	if (!str.empty()) {
-		readln(200);
+	writeln_nowait(str);
+	if (!str.empty() && m_echo) {
+		consume_echo(200);
 	}
 }
 
 int telnet::getc()
 {
 	int c = tcp::getc();
-	if (c == 0xff) {
-		c = tcp::getc();
-		if (c < 0xff) {
-			int opt = tcp::getc();
-			logger::d() << "telnet: received command " << c << "," << opt << endl;
-			if (c >= op_will && c <= op_dont) {
-				//logger::d() << "telnet: handling command " << c << "," << opt << endl;
-				//handle_op_opt(c, opt);
-			} else {
-				//logger::d() << "telnet: not handling command " << c << "," << opt << endl;
+	if (c != cmd_iac) {
+		return c ? c : ign;
+	}
+
+	c = tcp::getc();
+	if (c == cmd_iac || c == eof) {
+		return c;
+	} else if (c >= op_will && c <= op_dont) {
+		int opt = tcp::getc();
+		if (opt == eof) {
+			return eof;
+		}
+
+		handle_op_opt(c, opt);
+	} else if (c == cmd_sb) {
+		// we don't support any options that use subnegotiation
+		while ((c = tcp::getc()) != eof) {
+			if (c == cmd_iac && (c = tcp::getc()) == cmd_se) {
+				break;
 			}
-			return ign;
 		}
+	} else {
+		logger::d() << "telnet: ignoring command " << c << endl;
 	}
 
-	return c ? c : ign;
+	return ign;
 }
 
 // the bfc telnet server sends the following
@@ -667,43 +745,97 @@ int telnet::getc()
 //   ff fb 03 = WILL,supress-go-ahead
 //   ff fb 01 = WILL,ECHO
 //
-// currently, we only allow supress-go-ahead
-// and echo, and try to fend off everything else
-//
+// we allow suppress-go-ahead and binary mode, and refuse everything
+// else. refusing ECHO means that we don't have to consume the echo
+// of each line we write, if the server agrees.
+
+bool telnet::accept_opt(int opt) const
+{
+	return opt == opt_binary || opt == opt_suppress_ga;
+}
 
-#if 0
 void telnet::handle_op_opt(int op, int opt)
 {
-	if (op == op_will) {
-		if (opt == opt_suppres_ga || opt == opt_echo) {
-			send_op_opt(op_do, opt);
+	logger::d() << "telnet: received " << op << "," << opt << endl;
+
+	// to avoid negotiation loops, replies are only sent if the option's
+	// state changes, and if the command isn't a reply to our own request.
+	bool local = (op == op_do || op == op_dont);
+	bool enable = (op == op_will || op == op_do);
+	auto& enabled = local ? m_local : m_remote;
+	auto& pending = local ? m_local_pending : m_remote_pending;
+	bool reply = !pending[opt];
+	pending[opt] = false;
+
+	if (enable && !accept_opt(opt)) {
+		send_op_opt(local ? op_wont : op_dont, opt);
+		enable = false;
+	} else if (enable != enabled[opt] && reply) {
+		if (local) {
+			send_op_opt(enable ? op_will : op_wont, opt);
 		} else {
-			send_op_opt(op_dont, opt);
+			send_op_opt(enable ? op_do : op_dont, opt);
 		}
-	} else if (op == op_do) {
-		send_op_opt(op_wont, opt);
-	} else if (opt == op_wont) {
-		send_op_opt(op_dont, opt);
-	} else if (opt == op_dont) {
-		send_op_opt(op_wont, opt);
+	}
+
+	enabled[opt] = enable;
+
+	if (!local && opt == opt_echo && op == op_wont) {
+		logger::d() << "telnet: server echo disabled" << endl;
+		m_echo = false;
+	}
+}
+
+void telnet::request_opt(int opt, bool local)
+{
+	if (local) {
+		m_local_pending[opt] = true;
+		send_op_opt(op_will, opt);
+	} else {
+		m_remote_pending[opt] = true;
+		send_op_opt(op_do, opt);
 	}
 }
 
 void telnet::send_op_opt(int op, int opt)
 {
-	logger::d() << endl << "telnet: sending " << op << "," << opt << endl;
-	tcp::write(string("\xff") + char(op) + char(opt));
+	logger::d() << "telnet: sending " << op << "," << opt << endl;
+	tcp::write(string(1, char(cmd_iac)) + char(op) + char(opt));
 }
-#endif
+}
+
+void io::consume_echo(unsigned timeout)
+{
+	string line;
+
+	// since prompts are returned as soon as they're complete, the echo
+	// may be preceded by a prompt, rather than being on the same line.
+	if (readln(line, timeout) && m_prompt_check && m_prompt_check(line)) {
+		readln(line, timeout);
+	}
 }
 
 string io::readln(unsigned timeout)
 {
 	string line;
+	readln(line, timeout);
+	return line;
+}
+
+bool io::readln(string& line, unsigned timeout)
+{
 	bool lf = false, cr = false;
 	size_t i = 0;
 
-	while (pending(timeout)) {
+	line.clear();
+
+	while (true) {
+		if (i && i == line.size() && m_prompt_check && !pending(0) && m_prompt_check(line)) {
+			break;
+		} else if (!pending(timeout)) {
+			break;
+		}
+
 		int c = getc();
 		if (c == '\n') {
 			lf = true;
@@ -734,16 +866,21 @@ string io::readln(unsigned timeout)
 #ifdef DEBUG
 		logger::log_io(line, true);
 #endif
-		return line;
+		return true;
 	} else if (lf) {
 #ifdef DEBUG
 		logger::log_io("", true);
 #endif
+		line.assign(1, '\0');
+		return true;
 	}
 
-	return lf ? string("\0", 1) : "";
+	return false;
 }
 
+size_t io::s_recv_bufsize = 4096;
+std::atomic<unsigned long> io::s_recv_syscalls(0);
+
 shared_ptr<io> io::open_telnet(const string& address, unsigned short port)
 {
 	return make_shared<telnet>(address, port);
@@ -19,6 +19,8 @@
 
 #ifndef BCM2DUMP_IO_H
 #define BCM2DUMP_IO_H
+#include <functional>
+#include <atomic>
 #include <memory>
 #include <string>
 #include <list>
@@ -38,15 +40,49 @@ class io
 
 	virtual int getc() = 0;
 	virtual std::string readln(unsigned timeout = 0);
+	// like readln(), but reuses the storage of `line`. returns false if
+	// no line was read (an empty line is returned as a single NUL char).
+	bool readln(std::string& line, unsigned timeout = 0);
 	virtual std::string read(size_t length, bool partial = true) = 0;
 	virtual void writeln(const std::string& buf = "") = 0;
 	virtual void write(const std::string& buf) = 0;
+	// like writeln(), but doesn't consume the echo of the line. for use
+	// while the output of a previous command may still be arriving.
+	virtual void writeln_nowait(const std::string& buf)
+	{ write(buf + "\r\n"); }
 
 	virtual bool pending(unsigned timeout = 100) = 0;
 
+	// a prompt usually isn't followed by a newline, so readln() would wait
+	// for the timeout to expire before returning it. if no more data is
+	// available, the partial line is passed to `f`, and returned as soon
+	// as `f` returns true.
+	void set_prompt_check(std::function<bool(const std::string&)> f)
+	{ m_prompt_check = f; }
+
 	static sp open_serial(const char* tty, unsigned speed);
 	static sp open_telnet(const std::string& address, uint16_t port);
 	static sp open_tcp(const std::string& address, uint16_t port);
+
+	// size of the receive buffer used by file descriptor based
+	// implementations
+	static void recv_bufsize(size_t size)
+	{ s_recv_bufsize = size ? size : 1; }
+
+	// number of select()/read()/recv() calls issued so far
+	static unsigned long recv_syscalls()
+	{ return s_recv_syscalls; }
+
+	protected:
+	// consumes the echo of a line that was just written
+	void consume_echo(unsigned timeout);
+
+	static size_t s_recv_bufsize;
+	// updated by all sessions of a parallel dump
+	static std::atomic<unsigned long> s_recv_syscalls;
+
+	private:
+	std::function<bool(const std::string&)> m_prompt_check;
 };
 }
 
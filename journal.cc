@@ -0,0 +1,177 @@
+/**
+ * bcm2-utils
+ * Copyright (C) 2016 Joseph Lehner <joseph.c.lehner@gmail.com>
+ *
+ * bcm2-utils is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bcm2-utils is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with bcm2-utils.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <sstream>
+#include "journal.h"
+#include "util.h"
+
+using namespace std;
+
+namespace bcm2dump {
+
+journal::journal(const string& filename, const string& op, const string& space,
+		uint32_t offset, uint32_t length, uint32_t id, bool resume)
+: m_filename(filename), m_offset(offset)
+{
+	m_header = "bcm2dump-journal " + op + " " + space + " " + to_hex(offset)
+			+ " " + to_hex(length) + " " + to_hex(id);
+
+	if (resume) {
+		ifstream in(filename);
+		string line;
+
+		if (getline(in, line) && line == m_header) {
+			while (getline(in, line)) {
+				istringstream istr(line);
+				uint32_t off, len, crc;
+
+				// an interrupted write may have left an incomplete line
+				if ((istr >> hex >> off >> len >> crc) && len) {
+					m_entries.emplace(off, make_pair(len, crc));
+					add_range(off, len);
+				}
+			}
+
+			logger::d() << "journal: " << m_entries.size() << " completed range(s)" << endl;
+		} else if (in.good()) {
+			logger::i() << "journal " << filename << " describes a different operation; ignoring" << endl;
+		}
+	}
+
+	if (!m_entries.empty()) {
+		m_file.open(filename, ios::app);
+	} else {
+		write_header();
+	}
+
+	if (!m_file.good()) {
+		throw user_error("failed to open journal " + filename);
+	}
+}
+
+bool journal::empty() const
+{
+	lock_guard<mutex> lock(m_lock);
+	return m_entries.empty();
+}
+
+void journal::verify(istream& is)
+{
+	lock_guard<mutex> lock(m_lock);
+	size_t count = m_entries.size();
+
+	for (auto it = m_entries.begin(); it != m_entries.end();) {
+		string buf(it->second.first, '\0');
+		is.clear();
+
+		if (is.seekg(it->first - m_offset) && is.read(&buf[0], buf.size())
+				&& crc32(buf) == it->second.second) {
+			++it;
+		} else {
+			logger::d() << "journal: discarding range 0x" << to_hex(it->first) << ","
+					<< it->second.first << endl;
+			it = m_entries.erase(it);
+		}
+	}
+
+	is.clear();
+
+	if (m_entries.size() != count) {
+		m_ranges.clear();
+		for (auto e : m_entries) {
+			add_range(e.first, e.second.first);
+		}
+
+		logger::i() << "journal: " << (count - m_entries.size()) << " of " << count
+				<< " completed range(s) do not match" << endl;
+
+		// rewrite the journal, so it doesn't contain ranges we know to be bad
+		m_file.close();
+		write_header();
+
+		for (auto e : m_entries) {
+			m_file << to_hex(e.first) << " " << to_hex(e.second.first) << " " << to_hex(e.second.second) << endl;
+		}
+	}
+}
+
+uint32_t journal::completed_until(uint32_t offset) const
+{
+	lock_guard<mutex> lock(m_lock);
+
+	auto it = m_ranges.upper_bound(offset);
+	if (it == m_ranges.begin()) {
+		return offset;
+	}
+
+	--it;
+	return min<uint64_t>(max<uint64_t>(it->second, offset), UINT32_MAX);
+}
+
+void journal::add(uint32_t offset, const string& data)
+{
+	if (data.empty()) {
+		return;
+	}
+
+	lock_guard<mutex> lock(m_lock);
+	uint32_t crc = crc32(data);
+	m_entries.emplace(offset, make_pair(uint32_t(data.size()), crc));
+	add_range(offset, data.size());
+	m_file << to_hex(offset) << " " << to_hex(uint32_t(data.size())) << " " << to_hex(crc) << endl;
+}
+
+void journal::remove()
+{
+	lock_guard<mutex> lock(m_lock);
+	m_file.close();
+	m_entries.clear();
+	m_ranges.clear();
+	std::remove(m_filename.c_str());
+}
+
+void journal::add_range(uint32_t offset, uint32_t length)
+{
+	uint64_t begin = offset;
+	uint64_t end = begin + length;
+
+	auto it = m_ranges.upper_bound(begin);
+	if (it != m_ranges.begin() && prev(it)->second >= begin) {
+		--it;
+		begin = it->first;
+		end = max(end, it->second);
+		it = m_ranges.erase(it);
+	}
+
+	while (it != m_ranges.end() && it->first <= end) {
+		end = max(end, it->second);
+		it = m_ranges.erase(it);
+	}
+
+	m_ranges[begin] = end;
+}
+
+void journal::write_header()
+{
+	m_file.open(m_filename, ios::trunc);
+	m_file << m_header << endl;
+}
+}
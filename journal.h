@@ -0,0 +1,84 @@
+/**
+ * bcm2-utils
+ * Copyright (C) 2016 Joseph Lehner <joseph.c.lehner@gmail.com>
+ *
+ * bcm2-utils is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bcm2-utils is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with bcm2-utils.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef BCM2DUMP_JOURNAL_H
+#define BCM2DUMP_JOURNAL_H
+#include <fstream>
+#include <memory>
+#include <string>
+#include <mutex>
+#include <map>
+
+namespace bcm2dump {
+
+// records the ranges completed by a dump or write, along with the crc32
+// of their contents, so that an interrupted operation can be resumed. the
+// journal is a text file, which is appended to after each chunk:
+//
+// bcm2dump-journal <op> <space> <offset> <length> <id>
+// <offset> <length> <crc32>
+// ...
+//
+// all methods may be called from multiple threads.
+class journal
+{
+	public:
+	typedef std::shared_ptr<journal> sp;
+
+	// opens the journal `filename` for the specified operation. `id` is
+	// an arbitrary value identifying the local data (e.g. the crc32 of the
+	// file to be written). unless `resume` is set, or if the journal
+	// describes a different operation, it is discarded.
+	journal(const std::string& filename, const std::string& op, const std::string& space,
+			uint32_t offset, uint32_t length, uint32_t id = 0, bool resume = true);
+
+	// returns true if there are no completed ranges
+	bool empty() const;
+
+	// discards all completed ranges whose contents, as read from `is`, no
+	// longer match. the stream's position 0 corresponds to the operation's
+	// offset.
+	void verify(std::istream& is);
+
+	// returns the end of the completed range that contains `offset`,
+	// or `offset` itself if there is none.
+	uint32_t completed_until(uint32_t offset) const;
+
+	// records a completed range
+	void add(uint32_t offset, const std::string& data);
+
+	// deletes the journal file, once the operation has completed
+	void remove();
+
+	private:
+	void add_range(uint32_t offset, uint32_t length);
+	void write_header();
+
+	mutable std::mutex m_lock;
+	std::string m_filename;
+	std::string m_header;
+	std::ofstream m_file;
+	// offset => { length, crc32 }
+	std::multimap<uint32_t, std::pair<uint32_t, uint32_t>> m_entries;
+	// completed ranges, merged: begin => end
+	std::map<uint64_t, uint64_t> m_ranges;
+	uint32_t m_offset;
+};
+}
+#endif
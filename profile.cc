@@ -21,6 +21,7 @@
 #include <iostream>
 #include <cstring>
 #include <cctype>
+#include <mutex>
 #include <set>
 #include "profile.h"
 #include "util.h"
@@ -147,13 +148,13 @@ class profile_wrapper : public profile
 	virtual bcm2_arch arch() const override
 	{ return m_p->arch; }
 
-	virtual vector<const bcm2_magic*> magics() const override
+	virtual const vector<const bcm2_magic*>& magics() const override
 	{ return m_magic; }
 
-	virtual vector<addrspace> spaces() const override
+	virtual const vector<addrspace>& spaces() const override
 	{ return m_spaces; }
 
-	virtual vector<version> versions() const override
+	virtual const vector<version>& versions() const override
 	{ return m_versions; }
 
 	virtual const version& default_version(int intf) const override
@@ -434,6 +435,61 @@ const bcm2_typed_val* version::get_opt(const string& name, bcm2_type type) const
 	return get_version_opt(m_def, name, type);
 }
 
+resolved_version::resolved_version(const version& v)
+{
+	m_codecfg.printf = v.codecfg("printf");
+	m_codecfg.sscanf = v.codecfg("sscanf");
+	m_codecfg.scanf = v.codecfg("scanf");
+	m_codecfg.getline = v.codecfg("getline");
+	m_codecfg.buffer = v.codecfg("buffer");
+	m_codecfg.buflen = v.codecfg("buflen");
+	m_codecfg.rwcode = v.codecfg("rwcode");
+
+	for (int i = 0; i < opt_count; ++i) {
+		auto name = opt_name(static_cast<opt>(i));
+
+		// an option of the wrong type is only an error if it's actually
+		// used, so the exception is deferred until then.
+		try {
+			if (v.has_opt(name)) {
+				m_opts[i].n = v.get_opt_num(name);
+				m_opts[i].state = value::present;
+			}
+		} catch (const exception& e) {
+			m_opts[i].state = value::invalid;
+			m_opts[i].error = e.what();
+		}
+	}
+}
+
+uint32_t resolved_version::get_opt_num(opt id) const
+{
+	const value& val = m_opts[id];
+
+	if (val.state == value::present) {
+		return val.n;
+	} else if (val.state == value::invalid) {
+		throw runtime_error(val.error);
+	}
+
+	throw runtime_error(opt_name(id) + ": no such option"s);
+}
+
+const char* resolved_version::opt_name(opt id)
+{
+	static const char* names[opt_count] = {
+		"bfc:ram_readsize",
+		"bfc:ram_pipeline",
+		"bfc:flash_readsize",
+		"bfc:flash_read_direct",
+		"bfc:flash_reinit_on_retry",
+		"rwcode:write_window",
+		"rwx:adaptive_readsize",
+	};
+
+	return names[id];
+}
+
 addrspace::addrspace(const bcm2_addrspace* a, const profile& p)
 : m_p(a), m_profile_name(p.name())
 {
@@ -552,11 +608,46 @@ func addrspace::get_erase_func(bcm2_interface intf) const
 vector<profile::sp> profile::s_profiles;
 map<string, bcm2_typed_val> profile::s_overrides;
 
+namespace {
+mutex profiles_lock;
+
+// number of entries in bcm2_profiles
+size_t profile_count()
+{
+	static const size_t count = [] {
+		size_t n = 0;
+		while (bcm2_profiles[n].name[0]) {
+			++n;
+		}
+		return n;
+	}();
+
+	return count;
+}
+}
+
+const profile::sp& profile::get(size_t i)
+{
+	// profiles are parsed when first used, since parsing all of them is by
+	// far the most expensive part of starting up, if a profile was specified.
+	lock_guard<mutex> lock(profiles_lock);
+
+	if (s_profiles.empty()) {
+		s_profiles.resize(profile_count());
+	}
+
+	if (!s_profiles[i]) {
+		s_profiles[i] = make_shared<profile_wrapper>(&bcm2_profiles[i]);
+	}
+
+	return s_profiles[i];
+}
+
 const profile::sp& profile::get(const string& name)
 {
-	for (const profile::sp& p : list()) {
-		if (!strcasecmp(p->name().c_str(), name.c_str())) {
-			return p;
+	for (size_t i = 0; i < profile_count(); ++i) {
+		if (!strcasecmp(bcm2_profiles[i].name, name.c_str())) {
+			return get(i);
 		}
 	}
 
@@ -565,10 +656,8 @@ const profile::sp& profile::get(const string& name)
 
 const vector<profile::sp>& profile::list()
 {
-	if (s_profiles.empty()) {
-		for (const bcm2_profile* p = bcm2_profiles; p->name[0]; ++p) {
-			s_profiles.push_back(make_shared<profile_wrapper>(p));
-		}
+	for (size_t i = 0; i < profile_count(); ++i) {
+		get(i);
 	}
 
 	return s_profiles;
@@ -583,7 +672,7 @@ void profile::print_to_stdout(bool verbose) const
 	cout << row("pssig", 20, "0x" + to_hex(pssig())) << endl;
 	cout << row("blsig", 20, "0x" + to_hex(blsig())) << endl;
 
-	for (auto space : spaces()) {
+	for (const auto& space : spaces()) {
 		cout << endl << rpad(space.name(), 20) << "  0x" << to_hex(space.min());
 		if (space.size()) {
 			cout << " - 0x" << to_hex(space.min() + space.size() - 1);
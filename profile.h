@@ -398,6 +398,65 @@ class version
 	std::map<std::string, funcmap> m_functions;
 };
 
+// the parts of a version that are used while reading or writing, resolved
+// once per session. hot code (e.g. rwx::limits_read(), which is called for
+// each chunk) should use this instead of copying the version, which contains
+// several maps, and looking up options by name.
+class resolved_version
+{
+	public:
+	enum opt
+	{
+		bfc_ram_readsize,
+		bfc_ram_pipeline,
+		bfc_flash_readsize,
+		bfc_flash_read_direct,
+		bfc_flash_reinit_on_retry,
+		rwcode_write_window,
+		rwx_adaptive_readsize,
+		opt_count
+	};
+
+	struct codecfg_type
+	{
+		uint32_t printf = 0;
+		uint32_t sscanf = 0;
+		uint32_t scanf = 0;
+		uint32_t getline = 0;
+		uint32_t buffer = 0;
+		uint32_t buflen = 0;
+		uint32_t rwcode = 0;
+	};
+
+	resolved_version() : resolved_version(version()) {}
+	explicit resolved_version(const version& v);
+
+	const codecfg_type& codecfg() const
+	{ return m_codecfg; }
+
+	bool has_opt(opt id) const
+	{ return m_opts[id].state == value::present; }
+
+	uint32_t get_opt_num(opt id) const;
+
+	uint32_t get_opt_num(opt id, uint32_t def) const
+	{ return m_opts[id].state == value::absent ? def : get_opt_num(id); }
+
+	static const char* opt_name(opt id);
+
+	private:
+	struct value
+	{
+		enum { absent, present, invalid } state = absent;
+		uint32_t n = 0;
+		// exception message, if state == invalid
+		std::string error;
+	};
+
+	codecfg_type m_codecfg;
+	value m_opts[opt_count];
+};
+
 class addrspace
 {
 	public:
@@ -459,6 +518,9 @@ class addrspace
 	unsigned alignment() const
 	{ return !m_p->alignment ? (is_mem() ? 4 : 1) : m_p->alignment; }
 
+	uint32_t blocksize() const
+	{ return m_p->blocksize; }
+
 	const std::vector<part>& partitions() const
 	{ return m_partitions; }
 
@@ -519,10 +581,10 @@ class profile
 	virtual uint16_t pssig() const = 0;
 	virtual uint16_t blsig() const = 0;
 	virtual uint32_t kseg1() const = 0;
-	virtual std::vector<const bcm2_magic*> magics() const = 0;
-	virtual std::vector<version> versions() const = 0;
+	virtual const std::vector<const bcm2_magic*>& magics() const = 0;
+	virtual const std::vector<version>& versions() const = 0;
 	virtual const version& default_version(int intf) const = 0;
-	virtual std::vector<addrspace> spaces() const = 0;
+	virtual const std::vector<addrspace>& spaces() const = 0;
 	virtual const addrspace& space(const std::string& name, bcm2_interface intf) const = 0;
 	virtual const addrspace& ram() const = 0;
 	virtual bcm2_arch arch() const = 0;
@@ -545,10 +607,14 @@ class profile
 	static const std::vector<profile::sp>& list();
 
 	static void parse_opt_override(const std::string& str);
+	static void clear_opt_overrides()
+	{ s_overrides.clear(); }
 
 	friend class version;
 
 	private:
+	static const sp& get(size_t i);
+
 	static std::vector<profile::sp> s_profiles;
 	static std::map<std::string, bcm2_typed_val> s_overrides;
 };
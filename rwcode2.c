@@ -44,6 +44,47 @@
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 
+#define IS_FILL_WORD(w) ((w) == 0 || (w) == 0xffffffff)
+
+#define CRC32_UPDATE(crc, buf, len) \
+	do { \
+		uint32_t i, k; \
+		for (i = 0; i < len; ++i) { \
+			crc ^= ((unsigned char*)buf)[i]; \
+			for (k = 0; k < 8; ++k) { \
+				crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1)); \
+			} \
+		} \
+	} while (0)
+
+#define HEX_VAL(c) \
+	((c) >= '0' && (c) <= '9' ? (c) - '0' : \
+	 ((c) | 0x20) >= 'a' && ((c) | 0x20) <= 'f' ? ((c) | 0x20) - 'a' + 10 : -1)
+
+#define B64_CHAR(v) \
+	((v) < 26 ? 'A' + (v) : \
+	 (v) < 52 ? 'a' + ((v) - 26) : \
+	 (v) < 62 ? '0' + ((v) - 52) : \
+	 (v) == 62 ? '+' : '/')
+
+#define B64_VAL(c) \
+	((c) >= 'A' && (c) <= 'Z' ? (c) - 'A' : \
+	 (c) >= 'a' && (c) <= 'z' ? (c) - 'a' + 26 : \
+	 (c) >= '0' && (c) <= '9' ? (c) - '0' + 52 : \
+	 (c) == '+' ? 62 : (c) == '/' ? 63 : -1)
+
+// as boost::crc_ccitt_type (not reflected, initial value 0xffff)
+#define CRC16_CCITT_UPDATE(crc, buf, len) \
+	do { \
+		uint32_t i, k; \
+		for (i = 0; i < len; ++i) { \
+			crc ^= ((unsigned char*)buf)[i] << 8; \
+			for (k = 0; k < 8; ++k) { \
+				crc = ((crc << 1) ^ ((crc & 0x8000) ? 0x1021 : 0)) & 0xffff; \
+			} \
+		} \
+	} while (0)
+
 typedef uint32_t (*w3_fun)(uint32_t, uint32_t, uint32_t);
 typedef uint32_t (*w2_fun)(uint32_t, uint32_t);
 typedef int (*printf_fun)(const char*, ...);
@@ -68,52 +109,136 @@ void mips_read()
 		return;
 	}
 
-	uint32_t remaining = args->length - args->index;
-	uint32_t chunklen = MIN(remaining, args->chunklen);
-
-	if (!chunklen) {
-		return;
-	}
+	do {
+		uint32_t remaining = args->length - args->index;
+		uint32_t chunklen = MIN(remaining, args->chunklen);
 
-	uint32_t* buffer;
+		if (!chunklen) {
+			return;
+		}
 
-	if (args->fl_read) {
-		uint32_t arg1, arg2;
+		uint32_t* buffer;
 
-		if (args->flags & BCM2_READ_FUNC_OBL) {
-			arg1 = args->offset + args->index;
-			arg2 = args->buffer;
-		} else {
-			arg2 = args->offset + args->index;
+		if (args->fl_read) {
+			uint32_t arg1, arg2;
 
-			if (args->flags & BCM2_READ_FUNC_PBOL) {
-				arg1 = (uint32_t)&args->buffer;
+			if (args->flags & BCM2_READ_FUNC_OBL) {
+				arg1 = args->offset + args->index;
+				arg2 = args->buffer;
 			} else {
-				arg1 = args->buffer;
+				arg2 = args->offset + args->index;
+
+				if (args->flags & BCM2_READ_FUNC_PBOL) {
+					arg1 = (uint32_t)&args->buffer;
+				} else {
+					arg1 = args->buffer;
+				}
 			}
+
+			RWCODE_PATCH(args->patches);
+			((w3_fun)args->fl_read)(arg1, arg2, chunklen);
+			RWCODE_PATCH(args->patches);
+
+			buffer = (uint32_t*)args->buffer;
+		} else {
+			buffer = (uint32_t*)(args->buffer + args->index);
 		}
 
-		RWCODE_PATCH(args->patches);
-		((w3_fun)args->fl_read)(arg1, arg2, chunklen);
-		RWCODE_PATCH(args->patches);
+		args->index += chunklen;
 
-		buffer = (uint32_t*)args->buffer;
-	} else {
-		buffer = (uint32_t*)(args->buffer + args->index);
-	}
+		uint32_t crc = 0xffffffff;
 
-	args->index += chunklen;
+		if (args->flags & (BCM2_READ_CRC | BCM2_READ_HASH)) {
+			CRC32_UPDATE(crc, buffer, chunklen);
+		}
 
-	do {
-		for (int i = 0; i < 4; ++i) {
-			((printf_fun)args->printf)(args->str_x, *buffer++);
+		if (args->flags & BCM2_READ_HASH) {
+			goto out;
 		}
-		((printf_fun)args->printf)(args->str_nl);
-	} while ((chunklen -= 16));
+
+		if ((args->flags & BCM2_READ_ENC_MASK) != BCM2_READ_ENC_B64) {
+			do {
+				for (int i = 0; i < 4; ++i) {
+					((printf_fun)args->printf)(args->str_x, *buffer++);
+				}
+				((printf_fun)args->printf)(args->str_nl);
+			} while ((chunklen -= 16));
+
+			goto out;
+		}
+
+		uint32_t* end = buffer + (chunklen / 4);
+
+		while (buffer < end) {
+			uint32_t* p = buffer;
+
+			if (IS_FILL_WORD(*p)) {
+				while (p < end && *p == *buffer) {
+					++p;
+				}
+
+				if ((p - buffer) >= 4) {
+					((printf_fun)args->printf)(args->str_fill, *buffer & 0xff, (p - buffer) * 4);
+					((printf_fun)args->printf)(args->str_nl);
+					buffer = p;
+					continue;
+				}
+
+				p = buffer;
+			}
+
+			// stop at the beginning of a run that is long enough to be
+			// sent as a fill line.
+			do {
+				++p;
+			} while (p < end && (p - buffer) < 12 && !((p + 4) <= end
+						&& IS_FILL_WORD(*p) && p[1] == *p && p[2] == *p && p[3] == *p));
+
+			// the line consists of base64 characters only, so it can be
+			// passed to printf as the format string.
+			char line[72];
+			char* l = line;
+			unsigned char* b = (unsigned char*)buffer;
+			uint32_t len = (p - buffer) * 4;
+
+			*l++ = '@';
+
+			for (uint32_t i = 0; i < len; i += 3) {
+				uint32_t v = b[i] << 16;
+
+				if ((i + 1) < len) {
+					v |= b[i + 1] << 8;
+				}
+
+				if ((i + 2) < len) {
+					v |= b[i + 2];
+				}
+
+				*l++ = B64_CHAR((v >> 18) & 0x3f);
+				*l++ = B64_CHAR((v >> 12) & 0x3f);
+				*l++ = (i + 1) < len ? B64_CHAR((v >> 6) & 0x3f) : '=';
+				*l++ = (i + 2) < len ? B64_CHAR(v & 0x3f) : '=';
+			}
+
+			*l++ = '\r';
+			*l++ = '\n';
+			*l = '\0';
+
+			((printf_fun)args->printf)(line);
+			buffer = p;
+		}
+
+out:
+		if (args->flags & (BCM2_READ_CRC | BCM2_READ_HASH)) {
+			((printf_fun)args->printf)(args->str_crc, ~crc);
+			((printf_fun)args->printf)(args->str_nl);
+		}
+	} while ((args->flags & BCM2_READ_HASH) && args->index < args->length);
 }
 
 // INPUT format:
 // :%x:%x (word 1, word 2)
+// :%x:%x:%x:%x:%x:%x:%x:%x (BCM2_WRITE_WIDE; up to 8 words)
 // OUTPUT format
 // :%x (offset of word 1)
 void mips_write()
@@ -126,15 +251,20 @@ void mips_write()
 	}
 
 	bool ram = !args->fl_write;
+	bool wide = args->getline && (args->flags & BCM2_WRITE_WIDE);
 	uint32_t* buffer = (uint32_t*)(args->buffer + args->index);
 	uint32_t remaining = args->length - args->index;
 	uint32_t len = MIN(remaining, args->chunklen);
 	args->index += len;
 
+	int words;
+
 	do {
-		char line[38];
+		char line[80];
 		int n;
 
+		words = wide ? MIN(8, len / 4) : 2;
+
 		if (args->getline) {
 			((getline_fun)args->getline)(line, sizeof(line));
 			line[sizeof(line)-1] = 0;
@@ -143,17 +273,36 @@ void mips_write()
 				break;
 			}
 
-			// XXX it would be more efficient to scan 4 words at once.
-			// However, this would require a fifth argument to sscanf,
-			// and these are handled differently, depending on the MIPS
-			// ABI in use (n32 uses a register, o32 uses the stack).
+			if (wide) {
+				// sscanf can't be used here, since it would require more
+				// than 4 arguments. these are handled differently, depending
+				// on the MIPS ABI in use (n32 uses a register, o32 uses the stack).
+				char* c = line;
+
+				for (n = 0; n < words && *c == ':'; ++n) {
+					char* start = ++c;
+					uint32_t w = 0;
+					int d;
 
-			n = ((sscanf_fun)args->xscanf)(line, args->str_2x, buffer, buffer + 1);
+					while ((d = HEX_VAL(*c)) >= 0) {
+						w = (w << 4) | d;
+						++c;
+					}
+
+					if (c == start) {
+						break;
+					}
+
+					buffer[n] = w;
+				}
+			} else {
+				n = ((sscanf_fun)args->xscanf)(line, args->str_2x, buffer, buffer + 1);
+			}
 		} else {
 			n = ((scanf_fun)args->xscanf)(args->str_2x, buffer, buffer + 1);
 		}
 
-		if (n != 2) {
+		if (n != words) {
 			goto err;
 		}
 
@@ -166,8 +315,8 @@ void mips_write()
 		}
 
 		((printf_fun)args->printf)(args->str_nl);
-		buffer += 2;
-	} while ((len -= 8));
+		buffer += words;
+	} while ((len -= words * 4));
 
 	if (args->fl_write && args->index == args->length) {
 		if (args->fl_erase && args->flags & BCM2_ERASE_FUNC_OL) {
@@ -189,3 +338,50 @@ err:
 	((printf_fun)args->printf)(args->str_2x + 3, 0xdeadbeef);
 	((printf_fun)args->printf)(args->str_nl);
 }
+
+// INPUT format:
+// @<base64> (groups of 4 characters; no padding)
+// OUTPUT format:
+// :%x (number of bytes received so far, after each line)
+// #%x (crc16 of the data, once `length` bytes have been received)
+void mips_load()
+{
+	struct bcm2_load_args* args;
+	RWCODE_INIT_ARGS(args);
+
+	unsigned char* p = (unsigned char*)args->buffer;
+	unsigned char* end = p + args->length;
+
+	while (p < end) {
+		char line[80];
+		((getline_fun)args->getline)(line, sizeof(line));
+		line[sizeof(line) - 1] = 0;
+
+		if (*line != '@') {
+			break;
+		}
+
+		for (char* c = line + 1; c[0] && c[1] && c[2] && c[3]; c += 4) {
+			int a = B64_VAL(c[0]), b = B64_VAL(c[1]), d = B64_VAL(c[2]), e = B64_VAL(c[3]);
+
+			if (a < 0 || b < 0 || d < 0 || e < 0) {
+				break;
+			}
+
+			uint32_t v = (a << 18) | (b << 12) | (d << 6) | e;
+
+			for (int k = 16; k >= 0 && p < end; k -= 8) {
+				*p++ = v >> k;
+			}
+		}
+
+		((printf_fun)args->printf)(args->str_x, p - (unsigned char*)args->buffer);
+		((printf_fun)args->printf)(args->str_nl);
+	}
+
+	uint32_t crc = 0xffff;
+	CRC16_CCITT_UPDATE(crc, args->buffer, p - (unsigned char*)args->buffer);
+
+	((printf_fun)args->printf)(args->str_crc, crc);
+	((printf_fun)args->printf)(args->str_nl);
+}
@@ -24,6 +24,32 @@ extern "C" {
 // * load private data
 //   * if function call, do so now
 
+// output encoding of mips_read (bcm2_read_args.flags)
+#define BCM2_READ_ENC_MASK (3 << 24)
+// :%x:%x:%x:%x (4 words per line)
+#define BCM2_READ_ENC_HEX (0 << 24)
+// @<base64> (up to 48 bytes per line). runs of 16 bytes or more
+// of 0x00 or 0xff are sent as ~<fill>:<length>
+#define BCM2_READ_ENC_B64 (1 << 24)
+
+// each chunk is followed by #<crc32> (as in zlib's crc32)
+#define BCM2_READ_CRC (1 << 28)
+// instead of the data, print only the crc32 of each chunk, for all
+// chunks up to the end of the range.
+#define BCM2_READ_HASH (1 << 29)
+
+// mips_write: lines contain up to 8 words (:%x:%x:...), which are parsed
+// without using sscanf. requires bcm2_write_args.getline.
+#define BCM2_WRITE_WIDE (1 << 30)
+
+// not an argument flag: mips_load is available
+#define BCM2_RWCODE_LOAD (1 << 27)
+
+// flags that are understood by this version of the code. bin2hdr.rb
+// records these in rwcode2.inc as BCM2_RWCODE_INC_FEATURES.
+#define BCM2_RWCODE_FEATURES (BCM2_READ_ENC_B64 | BCM2_READ_CRC | BCM2_READ_HASH \
+		| BCM2_WRITE_WIDE | BCM2_RWCODE_LOAD)
+
 
 struct bcm2_read_args
 {
@@ -38,6 +64,8 @@ struct bcm2_read_args
 	uint32_t printf;
 	uint32_t fl_read;
 	struct bcm2_patch patches[BCM2_PATCH_NUM];
+	char str_fill[8];
+	char str_crc[4];
 } __attribute__((aligned(4)));
 
 void mips_read();
@@ -63,6 +91,19 @@ struct bcm2_write_args
 
 void mips_write();
 
+struct bcm2_load_args
+{
+	char str_x[4];
+	char str_nl[4];
+	char str_crc[4];
+	uint32_t buffer;
+	uint32_t length;
+	uint32_t printf;
+	uint32_t getline;
+} __attribute__((aligned(4)));
+
+void mips_load();
+
 #ifdef __cplusplus
 }
 #endif
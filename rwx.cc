@@ -22,6 +22,10 @@
 #include <cstddef>
 #include <fstream>
 #include <algorithm>
+#include <deque>
+#include <mutex>
+#include <map>
+#include <set>
 #include "progress.h"
 #include "rwcode2.h"
 #include "util.h"
@@ -125,28 +129,227 @@ template<class T> uint32_t get_stream_size(T& stream)
 	return length;
 }
 
+// adjusts the chunk size used by rwx::dump() within the bounds of
+// limits_read(). the throughput is measured over a window of several
+// chunks; the size is doubled as long as this improves throughput. after
+// repeated windows with retries, the size is halved, and never raised to
+// that size again. windows with retries aren't used for comparison.
+class chunk_tuner
+{
+	public:
+	chunk_tuner(const rwx::limits& lim, uint32_t size)
+	: m_min(max(lim.min, 1u)), m_max(max(lim.max, m_min)), m_ceiling(m_max)
+	{
+		m_size = clamp(size ? size : m_max);
+	}
+
+	uint32_t size() const
+	{ return m_size; }
+
+	// returns the size with the best throughput so far, or 0 if
+	// no window has been completed yet.
+	uint32_t best() const
+	{
+		uint32_t ret = 0;
+		double rate = 0;
+
+		for (auto p : m_rates) {
+			if (p.first <= m_ceiling && p.second > rate) {
+				ret = p.first;
+				rate = p.second;
+			}
+		}
+
+		return ret;
+	}
+
+	// returns true if any chunk had to be retried
+	bool retried() const
+	{ return m_retried; }
+
+	void update(uint32_t bytes, uint64_t msec, unsigned retries)
+	{
+		m_bytes += bytes;
+		m_msec += msec;
+		m_retries += retries;
+
+		if (++m_chunks < window_chunks && !m_retries) {
+			return;
+		}
+
+		double rate = double(m_bytes) / max(m_msec, uint64_t(1));
+
+		uint32_t next = m_size;
+
+		if (m_retries) {
+			m_retried = true;
+
+			// a single retry may be a transient error, so don't lower the
+			// ceiling unless retries happen in consecutive windows.
+			if (++m_failures >= failed_windows) {
+				next = clamp(m_size / 2);
+				m_ceiling = next;
+				m_failures = 0;
+			}
+		} else {
+			m_rates[m_size] = rate;
+			m_failures = 0;
+
+			uint32_t up = clamp(m_size * 2);
+			uint32_t down = clamp(m_size / 2);
+
+			if (up <= m_ceiling && up != m_size && (!m_rates.count(up) || m_rates[up] > rate)) {
+				next = up;
+			} else if (down != m_size && m_rates.count(down) && m_rates[down] > rate) {
+				next = down;
+			}
+		}
+
+		if (next != m_size) {
+			logger::d() << endl << "chunk size " << m_size << " -> " << next << " ("
+					<< uint32_t(rate * 1000) << " b/s, " << m_retries << " retries)" << endl;
+			m_size = next;
+		}
+
+		m_bytes = m_msec = 0;
+		m_chunks = m_retries = 0;
+	}
+
+	private:
+	static constexpr unsigned window_chunks = 4;
+	// consecutive windows with retries before the size is lowered
+	static constexpr unsigned failed_windows = 2;
+
+	uint32_t clamp(uint32_t size) const
+	{
+		return min(max(align_left(size, m_min), m_min), m_ceiling);
+	}
+
+	const uint32_t m_min;
+	const uint32_t m_max;
+	uint32_t m_ceiling;
+	uint32_t m_size;
+
+	uint64_t m_bytes = 0;
+	uint64_t m_msec = 0;
+	unsigned m_chunks = 0;
+	unsigned m_retries = 0;
+	unsigned m_failures = 0;
+	bool m_retried = false;
+	map<uint32_t, double> m_rates;
+};
+
+constexpr unsigned chunk_tuner::window_chunks;
+constexpr unsigned chunk_tuner::failed_windows;
+
+// the chunk sizes determined by chunk_tuner are stored in the cache
+// directory, one line ("<key> <size>") per profile, version, interface
+// and address space.
+mutex chunk_size_mutex;
+
+string chunk_size_key(const interface::sp& intf, const addrspace& space)
+{
+	string key = intf->profile() ? intf->profile()->name() : "generic";
+	key += ":" + intf->version().name() + ":" + intf->name() + ":" + space.name();
+	replace(key.begin(), key.end(), ' ', '_');
+	return key;
+}
+
+map<string, uint32_t> read_chunk_sizes(const string& filename)
+{
+	map<string, uint32_t> ret;
+	ifstream in(filename);
+	string key;
+	uint32_t size;
+
+	while (in >> key >> size) {
+		ret[key] = size;
+	}
+
+	return ret;
+}
+
+uint32_t load_chunk_size(const string& key)
+{
+	lock_guard<mutex> lock(chunk_size_mutex);
+	string filename = cache_filename("readsize");
+	if (filename.empty()) {
+		return 0;
+	}
+
+	auto sizes = read_chunk_sizes(filename);
+	auto it = sizes.find(key);
+	return it != sizes.end() ? it->second : 0;
+}
+
+void save_chunk_size(const string& key, uint32_t size)
+{
+	lock_guard<mutex> lock(chunk_size_mutex);
+	string filename = cache_filename("readsize");
+	if (filename.empty()) {
+		return;
+	}
+
+	auto sizes = read_chunk_sizes(filename);
+	if (sizes[key] == size) {
+		return;
+	}
+
+	sizes[key] = size;
+
+	ofstream out(filename, ios::trunc);
+	for (auto p : sizes) {
+		out << p.first << " " << p.second << endl;
+	}
+
+	if (!out) {
+		logger::d() << "failed to write " << filename << endl;
+	}
+}
+
 uint32_t parse_num(const string& str)
 {
 	return lexical_cast<uint32_t>(str, 0);
 }
 
-string parse_hex_data(const string& line, bool is_byte_data)
+// parses the hex number in line.substr(pos, digits), which must
+// not contain anything else.
+uint32_t parse_hex_at(const string& line, string::size_type pos, string::size_type digits)
 {
-	auto tok = split(line, ' ', false);
-	if (tok.empty()) {
-		throw bad_chunk_line::regular();
+	uint32_t n;
+	digits = pos < line.size() ? min(digits, line.size() - pos) : 0;
+
+	if (!digits || parse_hex_u32(line.data() + pos, line.data() + pos + digits, n) != digits) {
+		throw bad_chunk_line::regular("invalid hex number at " + to_string(pos) + " in '" + line + "'");
 	}
 
-	string linebuf;
+	return n;
+}
+
+// appends the data in `line` to `linebuf`
+void parse_hex_data(const string& line, bool is_byte_data, string& linebuf)
+{
+	const char* p = line.data();
+	const char* end = p + line.size();
+	auto size = linebuf.size();
+
+	while (true) {
+		while (p < end && *p == ' ') {
+			++p;
+		}
+
+		if (p == end) {
+			break;
+		}
 
-	for (auto num : tok) {
 		uint32_t n;
-		try {
-			n = hex_cast<uint32_t>(num);
-		} catch (const exception& e) {
-			throw bad_chunk_line::regular(e);
+		size_t digits = parse_hex_u32(p, end, n);
+		if (!digits || (p + digits < end && p[digits] != ' ')) {
+			throw bad_chunk_line::regular("invalid hex number at " + to_string(p - line.data()) + " in '" + line + "'");
 		}
 
+		p += digits;
+
 		if (is_byte_data) {
 			if (n > 0xff) {
 				throw bad_chunk_line::regular("invalid byte: 0x" + to_hex(n));
@@ -154,7 +357,74 @@ string parse_hex_data(const string& line, bool is_byte_data)
 
 			linebuf += char(n);
 		} else {
-			linebuf += to_buf(be_to_h(n));
+			n = be_to_h(n);
+			linebuf.append(reinterpret_cast<const char*>(&n), sizeof(n));
+		}
+	}
+
+	if (linebuf.size() == size) {
+		throw bad_chunk_line::regular();
+	}
+}
+
+string parse_hex_data(const string& line, bool is_byte_data)
+{
+	string linebuf;
+	parse_hex_data(line, is_byte_data, linebuf);
+	return linebuf;
+}
+
+int from_b64_char(char c)
+{
+	if (c >= 'A' && c <= 'Z') {
+		return c - 'A';
+	} else if (c >= 'a' && c <= 'z') {
+		return c - 'a' + 26;
+	} else if (c >= '0' && c <= '9') {
+		return c - '0' + 52;
+	} else if (c == '+') {
+		return 62;
+	} else if (c == '/') {
+		return 63;
+	}
+
+	return -1;
+}
+
+string parse_b64_data(const string& str)
+{
+	if (str.empty() || (str.size() % 4)) {
+		throw bad_chunk_line::regular("invalid base64 length " + to_string(str.size()));
+	}
+
+	string linebuf;
+	linebuf.reserve(3 * str.size() / 4);
+
+	for (string::size_type i = 0; i < str.size(); i += 4) {
+		uint32_t v = 0;
+		unsigned pad = 0;
+
+		for (unsigned k = 0; k < 4; ++k) {
+			int c = from_b64_char(str[i + k]);
+			if (c < 0) {
+				if (str[i + k] != '=' || k < 2 || (i + 4) != str.size()) {
+					throw bad_chunk_line::regular("invalid base64 data");
+				}
+				c = 0;
+				++pad;
+			} else if (pad) {
+				throw bad_chunk_line::regular("invalid base64 padding");
+			}
+
+			v = (v << 6) | c;
+		}
+
+		linebuf += char(v >> 16);
+		if (pad < 2) {
+			linebuf += char(v >> 8);
+		}
+		if (pad < 1) {
+			linebuf += char(v);
 		}
 	}
 
@@ -247,9 +517,17 @@ class parsing_rwx : public rwx
 
 	virtual string read_special(uint32_t offset, uint32_t length) override;
 
+	virtual bool prefetch_chunk(uint32_t offset, uint32_t length) override;
+
 	virtual unsigned chunk_timeout(uint32_t offset, uint32_t length) const
 	{ return 0; }
 
+	// maximum number of read commands that may be in flight. a value
+	// greater than 1 requires that parse_chunk_line() validates the
+	// offset of each line.
+	virtual unsigned pipeline_depth() const
+	{ return 1; }
+
 	virtual string read_chunk_impl(uint32_t offset, uint32_t length, uint32_t retries);
 	// issues a command that displays the requested chunk
 	virtual void do_read_chunk(uint32_t offset, uint32_t length) = 0;
@@ -257,13 +535,138 @@ class parsing_rwx : public rwx
 	virtual bool is_ignorable_line(const string& line) = 0;
 	// parses one line of data
 	virtual string parse_chunk_line(const string& line, uint32_t offset) = 0;
+	// parses one line of data, appending it to `chunk`. implementations
+	// that are used for large dumps should override this, to avoid creating
+	// a temporary string for each line.
+	virtual void append_chunk_line(const string& line, uint32_t offset, string& chunk)
+	{ chunk += parse_chunk_line(line, offset); }
+	// called after a chunk of the requested length was read. returns
+	// false if the chunk is corrupt.
+	virtual bool verify_chunk(uint32_t offset, const string& chunk)
+	{ return true; }
 	// called if a chunk was not successfully read
 	virtual void on_chunk_retry(uint32_t offset, uint32_t length) {}
+	// returns true if the data of an incomplete chunk may be kept, so that
+	// only the missing part is read again. this requires that all lines
+	// up to the first missing one are known to be correct, i.e. that
+	// parse_chunk_line() rejects lines that are not at the expected offset,
+	// or that the target has reported the checksum of the whole chunk.
+	virtual bool partial_retry() const
+	{ return false; }
+	// returns true, and sets `crc`, if the target has reported the crc32 of
+	// the whole chunk, even though the chunk itself was incomplete.
+	virtual bool incomplete_chunk_crc(uint32_t& crc) const
+	{ return false; }
 
 	bcm2dump::sp<cmdline_interface> interface() const
 	{ return dynamic_pointer_cast<cmdline_interface>(m_intf); }
+
+	// writes the command issued by do_read_chunk(). if another command is
+	// in flight, its output may already be arriving, so the echo of `cmd`
+	// isn't consumed here, but skipped by read_chunk_impl().
+	void write_read_command(const string& cmd);
+
+	private:
+	// waits for all pending read commands to complete
+	void drain_pipeline();
+	// returns true if `line` is the echo of a command in flight
+	bool is_echo(const string& line);
+
+	struct pending_read
+	{
+		uint32_t offset;
+		uint32_t length;
+		// the command's echo, if it is yet to be received
+		string echo;
+	};
+
+	deque<pending_read> m_pipeline;
+	// the echo of the command whose output is currently being read
+	string m_echo;
 };
 
+bool parsing_rwx::prefetch_chunk(uint32_t offset, uint32_t length)
+{
+	if (pipeline_depth() <= 1) {
+		return false;
+	}
+
+	auto it = find_if(m_pipeline.begin(), m_pipeline.end(), [offset, length] (const pending_read& r) {
+		return r.offset == offset && r.length == length;
+	});
+
+	if (it != m_pipeline.end()) {
+		// already requested
+		return true;
+	} else if (m_pipeline.size() >= pipeline_depth()) {
+		return false;
+	} else if (!m_pipeline.empty() && offset != (m_pipeline.back().offset + m_pipeline.back().length)) {
+		return false;
+	}
+
+	m_pipeline.push_back({ offset, length, "" });
+
+	try {
+		do_read_chunk(offset, length);
+	} catch (...) {
+		m_pipeline.pop_back();
+		throw;
+	}
+
+	return true;
+}
+
+void parsing_rwx::write_read_command(const string& cmd)
+{
+	if (m_pipeline.size() <= 1) {
+		interface()->writeln(cmd);
+	} else {
+		interface()->writeln_nowait(cmd);
+		m_pipeline.back().echo = cmd;
+	}
+}
+
+bool parsing_rwx::is_echo(const string& line)
+{
+	auto match = [&line] (string& echo) {
+		// the echo may be preceded by a prompt
+		if (!echo.empty() && ends_with(line, echo)) {
+			echo.clear();
+			return true;
+		}
+
+		return false;
+	};
+
+	if (match(m_echo)) {
+		return true;
+	}
+
+	for (auto& r : m_pipeline) {
+		if (match(r.echo)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void parsing_rwx::drain_pipeline()
+{
+	if (m_pipeline.empty()) {
+		return;
+	}
+
+	logger::d() << endl << "draining " << m_pipeline.size() << " pending read command(s)" << endl;
+
+	for (size_t i = 0; i < m_pipeline.size(); ++i) {
+		interface()->wait_ready();
+	}
+
+	m_pipeline.clear();
+	interface()->wait_quiet(50);
+}
+
 string parsing_rwx::read_special(uint32_t offset, uint32_t length)
 {
 	require_capability(cap_special);
@@ -280,36 +683,66 @@ string parsing_rwx::read_special(uint32_t offset, uint32_t length)
 
 string parsing_rwx::read_chunk_impl(uint32_t offset, uint32_t length, uint32_t retries)
 {
-	logger::t() << "read_chunk_impl: calling do_read_chunk" << endl;
+	bool pipelined = false;
+	m_echo.clear();
 
-	do_read_chunk(offset, length);
+	if (!m_pipeline.empty()) {
+		auto& front = m_pipeline.front();
+		if (!retries && front.offset == offset && front.length == length) {
+			m_echo = front.echo;
+			m_pipeline.pop_front();
+			pipelined = true;
+		} else {
+			drain_pipeline();
+		}
+	}
+
+	if (!pipelined) {
+		logger::t() << "read_chunk_impl: calling do_read_chunk" << endl;
+		do_read_chunk(offset, length);
+	}
 
 	uint32_t pos = offset;
 	string chunk;
 
 	logger::t() << "read_chunk_impl: consuming lines" << endl;
 
-	interface()->foreach_line_raw([this, &chunk, &pos, &length, &retries] (const string& line) {
+	// reused for each line
+	string tline;
+
+	interface()->foreach_line_view([this, &chunk, &tline, &pos, &length, &retries, &pipelined] (boost::string_view line) {
 		throw_if_interrupted();
-		string tline = trim(line);
-		if (!is_ignorable_line(tline)) {
+		tline.assign(line.data(), line.size());
+		trim_in_place(tline);
+		if (is_echo(tline)) {
+			return false;
+		} else if (!is_ignorable_line(tline)) {
+			auto size = chunk.size();
+
 			try {
-				string linebuf = parse_chunk_line(tline, pos);
-				pos += linebuf.size();
-				chunk += linebuf;
+				append_chunk_line(tline, pos, chunk);
+				pos += chunk.size() - size;
 				update_progress(pos, chunk.size());
 
-				if (linebuf.empty()) {
+				if (chunk.size() == size) {
 					logger::t() << "no bytes found in '" << tline << "'" << endl;
 				}
 			} catch (const bad_chunk_line& e) {
+				chunk.resize(size);
+
 				string msg = "bad chunk line @" + to_hex(pos) + ": '" + tline + "' (" + e.what() + ")";
 				if (e.critical() && retries >= max_retry_count) {
 					throw runtime_error(msg);
 				}
 
 				logger::t() << endl << msg << endl;
+
+				if (e.critical() && pipelined) {
+					// we're probably looking at the output of the next command
+					return true;
+				}
 			} catch (const exception& e) {
+				chunk.resize(size);
 				logger::d() << "error while parsing '" << tline << "': " << e.what() << endl;
 				return true;
 			}
@@ -320,18 +753,48 @@ string parsing_rwx::read_chunk_impl(uint32_t offset, uint32_t length, uint32_t r
 
 	logger::t() << "read_chunk_impl: done reading lines" << endl;
 
-	// consume any more output
-	interface()->wait_quiet(20);
+	string msg;
 
 	if (length && (chunk.size() != length)) {
-		string msg = "read incomplete chunk 0x" + to_hex(offset)
+		msg = "read incomplete chunk 0x" + to_hex(offset)
 					+ ": " + to_string(chunk.size()) + "/" +to_string(length);
+	} else if (!verify_chunk(offset, chunk)) {
+		msg = "checksum mismatch in chunk 0x" + to_hex(offset);
+	}
+
+	if (m_pipeline.empty()) {
+		// consume any more output, up to the prompt
+		interface()->wait_prompt(20);
+	}
+
+	if (!msg.empty()) {
+		drain_pipeline();
+
 		if (retries < max_retry_count) {
 			// if the dump is still underway, we need to wait for it to finish
 			// before issuing the next command. wait for up to 10 seconds.
 
 			if (interface()->wait_ready()) {
+				uint32_t keep = align_left(uint32_t(chunk.size()), max(limits_read().min, 1u));
+
+				if (keep && chunk.size() < length && partial_retry()) {
+					uint32_t crc;
+					bool have_crc = incomplete_chunk_crc(crc);
+
+					logger::d() << endl << msg << "; retrying at 0x" << to_hex(offset + keep) << endl;
+					++m_retries;
+					on_chunk_retry(offset + keep, length - keep);
+
+					chunk = chunk.substr(0, keep) + read_chunk_impl(offset + keep, length - keep, retries + 1);
+					if (!have_crc || crc32(chunk) == crc) {
+						return chunk;
+					}
+
+					msg = "checksum mismatch in chunk 0x" + to_hex(offset) + " after partial retry";
+				}
+
 				logger::d() << endl << msg << "; retrying" << endl;
+				++m_retries;
 				on_chunk_retry(offset, length);
 				return read_chunk_impl(offset, length, retries + 1);
 			}
@@ -372,6 +835,14 @@ class bfc_ram : public parsing_rwx
 	virtual bool is_ignorable_line(const string& line) override;
 	virtual void do_read_chunk(uint32_t offset, uint32_t length) override;
 	virtual string parse_chunk_line(const string& line, uint32_t offset) override;
+	virtual void append_chunk_line(const string& line, uint32_t offset, string& chunk) override;
+	virtual unsigned pipeline_depth() const override;
+
+	virtual bool adaptive_chunks() const override
+	{ return true; }
+
+	virtual bool partial_retry() const override
+	{ return true; }
 
 	private:
 	string m_diag_cmd;
@@ -381,10 +852,15 @@ class bfc_ram : public parsing_rwx
 
 rwx::limits bfc_ram::limits_read() const
 {
-	auto v = interface()->version();
+	auto& v = interface()->resolved();
 	// FIXME unify this for all parsing_rwx types
-	return { 4, 16, v.get_opt_num("bfc:ram_readsize", 2 * 8192) };
+	return { 4, 16, v.get_opt_num(resolved_version::bfc_ram_readsize, 2 * 8192) };
+
+}
 
+unsigned bfc_ram::pipeline_depth() const
+{
+	return interface()->resolved().get_opt_num(resolved_version::bfc_ram_pipeline, 1);
 }
 
 void bfc_ram::set_interface(const interface::sp& intf)
@@ -457,9 +933,9 @@ bool bfc_ram::write_chunk(uint32_t offset, const string& chunk)
 void bfc_ram::do_read_chunk(uint32_t offset, uint32_t length)
 {
 	if (m_diag_cmd.empty()) {
-		interface()->writeln("/read_memory -s 4 -n " + to_string(length) + " 0x" + to_hex(offset));
+		write_read_command("/read_memory -s 4 -n " + to_string(length) + " 0x" + to_hex(offset));
 	} else {
-		interface()->writeln(m_diag_cmd + " readmem -s 4 -n " + to_string(length) + " 0x" + to_hex(offset));
+		write_read_command(m_diag_cmd + " readmem -s 4 -n " + to_string(length) + " 0x" + to_hex(offset));
 	}
 }
 
@@ -480,38 +956,56 @@ bool bfc_ram::is_ignorable_line(const string& line)
 
 string bfc_ram::parse_chunk_line(const string& line, uint32_t offset)
 {
-	const char* fmts[] = {
-		"%x: %x  %x  %x  %x",
-		"%u: %u  %u  %u  %u",
-	};
+	string linebuf;
+	append_chunk_line(line, offset, linebuf);
+	return linebuf;
+}
+
+void bfc_ram::append_chunk_line(const string& line, uint32_t offset, string& chunk)
+{
+	const char* p = line.c_str();
+	const char* end = p + line.size();
 
 	uint32_t data[4];
-	uint32_t off;
-	int n;
+	uint32_t off = 0;
+	int n = 0;
+
+	// <offset>: <word>  <word>  <word>  <word>  | <ascii>
+	size_t digits = parse_hex_u32(p, end, off);
+	if (digits && (p + digits) < end && p[digits] == ':') {
+		for (p += digits + 1, n = 1; n < 5; ++n) {
+			while (p < end && *p == ' ') {
+				++p;
+			}
 
-	for (const char* fmt : fmts) {
-		n = sscanf(line.c_str(), fmt, &off, &data[0],
-				&data[1], &data[2], &data[3]);
+			if (!(digits = parse_hex_u32(p, end, data[n - 1]))) {
+				break;
+			}
 
-		if (n > 1 && off == offset) {
-			break;
+			p += digits;
 		}
 	}
 
+	if (n <= 1 || off != offset) {
+		// if another message is printed by the firmware, the dump
+		// output sometimes switches to an all-decimal format.
+		n = sscanf(line.c_str(), "%u: %u  %u  %u  %u", &off, &data[0],
+				&data[1], &data[2], &data[3]);
+	}
+
 	if (!n) {
 		throw bad_chunk_line::regular();
 	} else if (off != offset) {
 		throw bad_chunk_line::critical("offset mismatch");
 	}
 
-	string linebuf;
-
 	for (int i = 0; i < (n - 1); ++i) {
-		linebuf += to_buf(be_to_h(data[i]));
+		data[i] = be_to_h(data[i]);
 	}
 
-	return linebuf;
-
+	if (n > 1) {
+		chunk.append(reinterpret_cast<const char*>(data), (n - 1) * sizeof(data[0]));
+	}
 }
 
 class bfc_flash2 : public bfc_ram
@@ -524,13 +1018,12 @@ class bfc_flash2 : public bfc_ram
 
 	static bool is_supported(const interface::sp& intf, const string& space)
 	{
-		auto ver = intf->version();
+		auto& ver = intf->version();
 		if (ver.name().empty()) {
 			return false;
 		}
 
-		auto cfg = ver.codecfg();
-		if (!cfg["buffer"]) {
+		if (!intf->resolved().codecfg().buffer) {
 			return false;
 		}
 
@@ -547,9 +1040,8 @@ class bfc_flash2 : public bfc_ram
 	{
 		bfc_ram::init(offset, length, write);
 
-		auto ver = interface()->version();
-		m_cfg = ver.codecfg();
-		uint32_t buflen = m_cfg["buflen"];
+		m_cfg = interface()->resolved().codecfg();
+		uint32_t buflen = m_cfg.buflen;
 
 		if (buflen && length > buflen) {
 			throw user_error("requested length exceeds buffer size ("
@@ -558,7 +1050,7 @@ class bfc_flash2 : public bfc_ram
 
 		m_dump_offset = offset;
 		m_dump_length = length;
-		m_funcs = ver.functions(m_space.name());
+		m_funcs = interface()->version().functions(m_space.name());
 
 		call_open_close("open", offset, length);
 
@@ -576,15 +1068,30 @@ class bfc_flash2 : public bfc_ram
 		return 5 * 1000;
 	}
 
-	virtual string parse_chunk_line(const string& line, uint32_t offset) override
+	virtual unsigned pipeline_depth() const override
+	{
+		// all reads share the same buffer
+		return 1;
+	}
+
+	virtual bool adaptive_chunks() const override
+	{
+		// lines are parsed relative to the buffer
+		return false;
+	}
+
+	virtual bool partial_retry() const override
+	{ return false; }
+
+	virtual void append_chunk_line(const string& line, uint32_t offset, string& chunk) override
 	{
-		return bfc_ram::parse_chunk_line(line, m_cfg["buffer"] + (offset % limits_read().max));
+		bfc_ram::append_chunk_line(line, m_cfg.buffer + (offset % limits_read().max), chunk);
 	}
 
 	virtual void do_read_chunk(uint32_t offset, uint32_t length) override
 	{
 		call_read(offset, length);
-		bfc_ram::do_read_chunk(m_cfg["buffer"], length);
+		bfc_ram::do_read_chunk(m_cfg.buffer, length);
 	}
 
 	private:
@@ -608,9 +1115,9 @@ class bfc_flash2 : public bfc_ram
 		if (read.addr()) {
 			string cmd = mkcmd(read);
 			if (read.args() == BCM2_READ_FUNC_BOL) {
-				add_args(cmd, { m_cfg["buffer"], offset, length });
+				add_args(cmd, { m_cfg.buffer, offset, length });
 			} else if (read.args() == BCM2_READ_FUNC_OBL) {
-				add_args(cmd, { offset, m_cfg["buffer"], length });
+				add_args(cmd, { offset, m_cfg.buffer, length });
 			} else {
 				throw runtime_error("unsupported 'read' args");
 			}
@@ -659,7 +1166,7 @@ class bfc_flash2 : public bfc_ram
 	uint32_t m_dump_offset = 0;
 	uint32_t m_dump_length = 0;
 	version::funcmap m_funcs;
-	version::u32map m_cfg;
+	resolved_version::codecfg_type m_cfg;
 };
 
 class bfc_flash : public parsing_rwx
@@ -682,8 +1189,12 @@ class bfc_flash : public parsing_rwx
 	virtual void do_read_chunk(uint32_t offset, uint32_t length) override;
 	virtual bool is_ignorable_line(const string& line) override;
 	virtual string parse_chunk_line(const string& line, uint32_t offset) override;
+	virtual void append_chunk_line(const string& line, uint32_t offset, string& chunk) override;
 	virtual void on_chunk_retry(uint32_t offset, uint32_t length) override;
 
+	virtual bool adaptive_chunks() const override
+	{ return limits_read().min < limits_read().max; }
+
 	private:
 	uint32_t to_partition_offset(uint32_t offset) const;
 	bool use_direct_read() const;
@@ -691,9 +1202,9 @@ class bfc_flash : public parsing_rwx
 
 rwx::limits bfc_flash::limits_read() const
 {
-	auto v = interface()->version();
+	auto& v = interface()->resolved();
 	// FIXME unify this for all parsing_rwx types
-	auto readsize = v.get_opt_num("bfc:flash_readsize", 0);
+	auto readsize = v.get_opt_num(resolved_version::bfc_flash_readsize, 0);
 	if (readsize) {
 		return { readsize, readsize, readsize };
 	} else {
@@ -778,6 +1289,11 @@ string bfc_flash::parse_chunk_line(const string& line, uint32_t offset)
 	return parse_hex_data(line, use_direct_read());
 }
 
+void bfc_flash::append_chunk_line(const string& line, uint32_t offset, string& chunk)
+{
+	parse_hex_data(line, use_direct_read(), chunk);
+}
+
 uint32_t bfc_flash::to_partition_offset(uint32_t offset) const
 {
 	if (offset < m_partition.offset()) {
@@ -790,10 +1306,10 @@ uint32_t bfc_flash::to_partition_offset(uint32_t offset) const
 
 bool bfc_flash::use_direct_read() const
 {
-	auto v = interface()->version();
+	auto& v = interface()->resolved();
 
-	if (v.has_opt("bfc:flash_read_direct")) {
-		return v.get_opt_num("bfc:flash_read_direct");
+	if (v.has_opt(resolved_version::bfc_flash_read_direct)) {
+		return v.get_opt_num(resolved_version::bfc_flash_read_direct);
 	}
 
 #ifdef BFC_FLASH_READ_DIRECT
@@ -805,9 +1321,7 @@ bool bfc_flash::use_direct_read() const
 
 void bfc_flash::on_chunk_retry(uint32_t offset, uint32_t length)
 {
-	auto v = interface()->version();
-
-	if (v.get_opt_num("bfc:flash_reinit_on_retry", false)) {
+	if (interface()->resolved().get_opt_num(resolved_version::bfc_flash_reinit_on_retry, false)) {
 		cleanup();
 		init(0, 0, false);
 	}
@@ -897,11 +1411,11 @@ bool bootloader_ram::is_ignorable_line(const string& line)
 string bootloader_ram::parse_chunk_line(const string& line, uint32_t offset)
 {
 	if (line.find("Value at") == 0) {
-		if (offset != hex_cast<uint32_t>(line.substr(9, 8))) {
+		if (offset != parse_hex_at(line, 9, 8)) {
 			throw bad_chunk_line::critical("offset mismatch");
 		}
 
-		return to_buf(h_to_be(hex_cast<uint32_t>(line.substr(19, 8))));
+		return to_buf(h_to_be(parse_hex_at(line, 19, 8)));
 	}
 
 	throw bad_chunk_line::regular();
@@ -962,7 +1476,7 @@ class bootloader_flash : public parsing_rwx
 
 	virtual string parse_chunk_line(const string& line, uint32_t offset) override
 	{
-		if (offset != hex_cast<uint32_t>(line.substr(0, 8))) {
+		if (offset != parse_hex_at(line, 0, 8)) {
 			throw bad_chunk_line::critical("offset mismatch");
 		}
 
@@ -1065,7 +1579,7 @@ bool bolt_ram::is_ignorable_line(const string& line)
 
 string bolt_ram::parse_chunk_line(const string& line, uint32_t offset)
 {
-	if (offset != hex_cast<uint32_t>(line.substr(0, 8))) {
+	if (offset != parse_hex_at(line, 0, 8)) {
 		throw bad_chunk_line::critical("offset mismatch");
 	}
 
@@ -1075,6 +1589,11 @@ string bolt_ram::parse_chunk_line(const string& line, uint32_t offset)
 // this defines uint32 dumpcode[] and writecode[]
 #include "rwcode2.inc"
 
+#ifndef BCM2_RWCODE_INC_FEATURES
+// rwcode2.inc was generated by an older version of bin2hdr.rb
+#define BCM2_RWCODE_INC_FEATURES 0
+#endif
+
 class code_rwx : public parsing_rwx
 {
 	public:
@@ -1097,10 +1616,10 @@ class code_rwx : public parsing_rwx
 			throw runtime_error("code dumper requires a profile");
 		}
 
-		auto cfg = intf->version().codecfg();
-		if (!cfg["rwcode"] || !cfg["buffer"] || !cfg["printf"]) {
+		auto& cfg = intf->resolved().codecfg();
+		if (!cfg.rwcode || !cfg.buffer || !cfg.printf) {
 			throw runtime_error("insufficient profile information for code dumper");
-		} else if (cfg["rwcode"] & 0xfff) {
+		} else if (cfg.rwcode & 0xfff) {
 			throw runtime_error("rwcode address must be aligned to 4k");
 		}
 
@@ -1110,36 +1629,113 @@ class code_rwx : public parsing_rwx
 	protected:
 	virtual void do_read_chunk(uint32_t offset, uint32_t length) override
 	{
+		uint32_t index = offset - m_rw_offset;
+
+		// when retrying the tail of a chunk, the target must not read
+		// beyond the end of that chunk.
+		set_read_index(index);
+		set_read_length(length < limits_read().max ? index + length : m_rw_length);
+		m_have_chunk_crc = false;
 		m_ram->exec(m_loadaddr + m_entry);
+		m_read_index += length;
 	}
 
-	virtual bool is_ignorable_line(const string& line) override
+	virtual vector<uint32_t> hash_chunks(uint32_t offset, uint32_t length) override
 	{
-		if (line.size() >= 8 && line.size() <= 36) {
-			if (line[0] == ':') {
-				return false;
-			}
+		if (!(BCM2_RWCODE_INC_FEATURES & BCM2_READ_HASH) || m_write) {
+			return {};
 		}
 
-		return true;
-	}
+		uint32_t count = (length + limits_read().max - 1) / limits_read().max;
+		vector<uint32_t> ret;
 
-	virtual string parse_chunk_line(const string& line, uint32_t offset) override
-	{
-		string linebuf;
+		set_read_index(offset - m_rw_offset);
+		set_read_length(m_rw_length);
+		set_read_flags(m_read_flags | BCM2_READ_HASH);
+		m_ram->exec(m_loadaddr + m_entry);
 
-		auto values = split(line.substr(1), ':');
-		auto lim = limits_read();
+		// the target calculates checksums up to the end of the range
+		// passed to init(), so we may receive more than we've asked for.
+		while (ret.size() < count) {
+			throw_if_interrupted();
 
-		if (values.size() < (lim.min / 4) || values.size() > (lim.max / 4)) {
-			throw runtime_error("invalid chunk line: '" + line + "'");
-		}
+			string line = trim(interface()->readln(max(chunk_timeout(offset, length), 10000u)));
+			if (line.empty()) {
+				throw runtime_error("timeout while reading checksums");
+			} else if (line[0] != '#') {
+				continue;
+			}
 
-		for (string val : values) {
-			linebuf += to_buf(h_to_be(hex_cast<uint32_t>(val)));
+			ret.push_back(hex_cast<uint32_t>(line.substr(1)));
 		}
 
-		return linebuf;
+		interface()->wait_ready();
+		m_read_index = m_rw_length;
+		set_read_flags(m_read_flags);
+
+		return ret;
+	}
+
+	virtual bool is_ignorable_line(const string& line) override
+	{
+		if (m_read_crc && line.size() >= 2 && line[0] == '#') {
+			// we only get here if the chunk is incomplete
+			try {
+				m_chunk_crc = hex_cast<uint32_t>(line.substr(1));
+				m_have_chunk_crc = true;
+			} catch (const exception& e) {
+				logger::t() << "bad checksum line '" << line << "'" << endl;
+			}
+
+			return true;
+		}
+
+		if (line.size() >= 8 && line.size() <= 36) {
+			if (line[0] == ':') {
+				return false;
+			}
+		}
+
+		if (m_read_enc == BCM2_READ_ENC_B64) {
+			if (line.size() >= 5 && line.size() <= 65 && line[0] == '@') {
+				return false;
+			} else if (line.size() >= 4 && line[0] == '~') {
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	virtual string parse_chunk_line(const string& line, uint32_t offset) override
+	{
+		if (line[0] == '@') {
+			return parse_b64_data(line.substr(1));
+		} else if (line[0] == '~') {
+			return parse_fill_line(line);
+		}
+
+		string linebuf;
+		auto lim = limits_read();
+
+		// :<word>:<word>:<word>:<word>
+		for (const char* p = line.c_str(), *end = p + line.size(); p < end; ) {
+			uint32_t val;
+			size_t digits = (*p == ':') ? parse_hex_u32(p + 1, end, val) : 0;
+
+			if (!digits || linebuf.size() >= lim.max) {
+				throw runtime_error("invalid chunk line: '" + line + "'");
+			}
+
+			linebuf += to_buf(h_to_be(val));
+			p += digits + 1;
+		}
+
+		if (linebuf.size() < lim.min) {
+			throw runtime_error("invalid chunk line: '" + line + "'");
+		}
+
+		return linebuf;
 	}
 
 	protected:
@@ -1147,27 +1743,39 @@ class code_rwx : public parsing_rwx
 	{
 		m_ram->exec(m_loadaddr + m_entry);
 
-		for (size_t i = 0; i < chunk.size(); i += limits_write().min) {
+		// with wide lines, up to `window` lines are sent before
+		// waiting for the target's acknowledgement.
+		size_t step = m_write_wide ? 32 : limits_write().min;
+		size_t window = m_write_wide ? interface()->resolved().get_opt_num(resolved_version::rwcode_write_window, 4) : 1;
+		vector<string> lines;
+
+		for (size_t i = 0; i < chunk.size(); i += step) {
 			string line;
 
-			for (size_t k = 0; k < limits_write().min / 4; ++k) {
-				line += ":" + to_hex(chunk.substr(i + k * 4, 4));
+			for (size_t k = i; k < min(i + step, chunk.size()); k += 4) {
+				line += ":" + to_hex(chunk.substr(k, 4));
 			}
 
-			interface()->writeln(line);
+			lines.push_back(line);
+		}
 
-			line = trim(interface()->readln());
-			if (line.empty() || line[0] != ':') {
+		interface()->writeln_windowed(lines, window, [this, offset, step] (const string& line, size_t index) {
+			if (line[0] != ':') {
 				throw runtime_error("expected offset, got '" + line + "'");
+			} else if (line.find(':', 1) != string::npos) {
+				// echoed data line
+				return false;
 			}
 
+			uint32_t expected = offset + index * step;
 			uint32_t actual = hex_cast<uint32_t>(line.substr(1));
-			if (actual != (offset + i)) {
-				throw runtime_error("expected offset 0x" + to_hex(offset + i, 8) + ", got 0x" + to_hex(actual));
+			if (actual != expected) {
+				throw runtime_error("expected offset 0x" + to_hex(expected, 8) + ", got 0x" + to_hex(actual));
 			}
 
-			update_progress(offset + i, 16);
-		}
+			update_progress(expected, step);
+			return true;
+		});
 
 		if (!space().is_ram()) {
 			// FIXME
@@ -1177,6 +1785,58 @@ class code_rwx : public parsing_rwx
 		return true;
 	}
 
+	string parse_fill_line(const string& line)
+	{
+		auto values = split(line.substr(1), ':');
+		if (values.size() != 2) {
+			throw bad_chunk_line::regular("invalid fill line");
+		}
+
+		uint32_t fill = hex_cast<uint32_t>(values[0]);
+		uint32_t length = hex_cast<uint32_t>(values[1]);
+
+		if ((fill != 0x00 && fill != 0xff) || !length || (length % 4) || length > limits_read().max) {
+			throw bad_chunk_line::regular("invalid fill line");
+		}
+
+		return string(length, char(fill));
+	}
+
+	virtual bool verify_chunk(uint32_t offset, const string& chunk) override
+	{
+		if (!m_read_crc) {
+			return true;
+		}
+
+		// the checksum line immediately follows the last data line
+		for (unsigned i = 0; i < 3; ++i) {
+			string line = trim(interface()->readln(1000));
+			if (line.empty()) {
+				break;
+			} else if (line[0] != '#') {
+				logger::t() << "ignoring '" << line << "' while waiting for checksum" << endl;
+				continue;
+			}
+
+			try {
+				uint32_t expected = hex_cast<uint32_t>(line.substr(1));
+				if (expected == crc32(chunk)) {
+					return true;
+				}
+
+				logger::d() << endl << "chunk 0x" << to_hex(offset) << ": expected crc32 "
+						<< to_hex(expected) << ", got " << to_hex(crc32(chunk)) << endl;
+			} catch (const exception& e) {
+				logger::d() << endl << "bad checksum line '" << line << "'" << endl;
+			}
+
+			return false;
+		}
+
+		logger::d() << endl << "chunk 0x" << to_hex(offset) << ": no checksum received" << endl;
+		return false;
+	}
+
 	bool is_prompt_line(const string& line, uint32_t offset)
 	{
 		if (line.empty() || line[0] != ':') {
@@ -1203,13 +1863,51 @@ class code_rwx : public parsing_rwx
 		}
 
 		if (!m_write) {
-			uint32_t index = offset - m_rw_offset;
-			m_ram->write(m_loadaddr + offsetof(bcm2_read_args, index), to_buf(h_to_be(index)));
+			set_read_index(offset - m_rw_offset);
 		} else {
 			// TODO: implement if we ever use on_chunk_retry for writes
 		}
 	}
 
+	bool write_chunks_committed() const override
+	{
+		// the target writes to flash after receiving the last chunk
+		return space().is_mem();
+	}
+
+	bool partial_retry() const override
+	{
+		// without a checksum, we can't tell whether a line was lost
+		return !m_write && m_have_chunk_crc;
+	}
+
+	bool incomplete_chunk_crc(uint32_t& crc) const override
+	{
+		crc = m_chunk_crc;
+		return m_have_chunk_crc;
+	}
+
+	void set_read_index(uint32_t index)
+	{
+		if (index != m_read_index) {
+			m_ram->write(m_loadaddr + offsetof(bcm2_read_args, index), to_buf(h_to_be(index)));
+			m_read_index = index;
+		}
+	}
+
+	void set_read_length(uint32_t length)
+	{
+		if (length != m_read_length) {
+			m_ram->write(m_loadaddr + offsetof(bcm2_read_args, length), to_buf(h_to_be(length)));
+			m_read_length = length;
+		}
+	}
+
+	void set_read_flags(uint32_t flags)
+	{
+		m_ram->write(m_loadaddr + offsetof(bcm2_read_args, flags), to_buf(h_to_be(flags)));
+	}
+
 	unsigned chunk_timeout(uint32_t offset, uint32_t length) const override
 	{
 		if (offset != m_rw_offset || space().is_mem()) {
@@ -1222,11 +1920,11 @@ class code_rwx : public parsing_rwx
 	void init(uint32_t offset, uint32_t length, bool write) override
 	{
 		const profile::sp& profile = interface()->profile();
-		auto cfg = interface()->version().codecfg();
+		auto& cfg = interface()->resolved().codecfg();
 
-		if (cfg["buflen"] && length > cfg["buflen"]) {
+		if (cfg.buflen && length > cfg.buflen) {
 			throw user_error("requested length exceeds buffer size ("
-					+ to_string(cfg["buflen"]) + " b)");
+					+ to_string(cfg.buflen) + " b)");
 		}
 
 #if 0
@@ -1238,9 +1936,11 @@ class code_rwx : public parsing_rwx
 		m_write = write;
 		m_rw_offset = offset;
 		m_rw_length = length;
+		m_read_index = 0;
+		m_read_length = length;
 
 		uint32_t kseg1 = profile->kseg1();
-		m_loadaddr = kseg1 | (cfg["rwcode"] + (write ? 0 : 0 /*0x10000*/));
+		m_loadaddr = kseg1 | (cfg.rwcode + (write ? 0 : 0 /*0x10000*/));
 
 		string code;
 
@@ -1276,34 +1976,162 @@ class code_rwx : public parsing_rwx
 			ofstream("code.bin").write(code.data(), code.size());
 #endif
 
-			progress pg;
-			progress_init(&pg, m_loadaddr, code.size());
-
 			if (m_prog_l && !quick) {
 				logger::i("updating code at 0x%08x (%u b)\n", m_loadaddr, static_cast<unsigned>(code.size()));
 			}
 
-			for (unsigned pass = 0; pass < 2; ++pass) {
-				string ramcode = m_ram->read(m_loadaddr, code.size());
-				for (uint32_t i = 0; i < code.size(); i += 4) {
-					if (!quick && pass == 0 && m_prog_l) {
-						progress_add(&pg, 4);
-						logger::i("\r ");
-						progress_print(&pg, stdout);
-					}
+			if (quick) {
+				// only the arguments may have changed
+				upload_code(m_loadaddr, code.substr(0, m_entry), false);
+			} else if (!load_code(code)) {
+				upload_code(m_loadaddr, code, m_prog_l != nullptr);
+			}
 
-					if (ramcode.substr(i, 4) != code.substr(i, 4)) {
-						if (pass == 1) {
-							throw runtime_error("dump code verification failed at 0x" + to_hex(i + m_loadaddr, 8));
-						}
-						m_ram->write(m_loadaddr + i, code.substr(i, 4));
-					}
+			logger::i("\n");
+		}
+	}
+
+	// writes all words that differ, and then verifies these
+	void upload_code(uint32_t addr, const string& code, bool show_progress)
+	{
+		progress pg;
+		progress_init(&pg, addr, code.size());
+
+		string ramcode = m_ram->read(addr, code.size());
+		vector<uint32_t> written;
+
+		for (uint32_t i = 0; i < code.size(); i += 4) {
+			if (show_progress) {
+				progress_add(&pg, 4);
+				logger::i("\r ");
+				progress_print(&pg, stdout);
+			}
+
+			if (ramcode.substr(i, 4) != code.substr(i, 4)) {
+				m_ram->write(addr + i, code.substr(i, 4));
+				written.push_back(i);
+			}
+		}
+
+		for (uint32_t i : written) {
+			if (m_ram->read(addr + i, 4) != code.substr(i, 4)) {
+				throw runtime_error("dump code verification failed at 0x" + to_hex(i + addr, 8));
+			}
+		}
+	}
+
+#if BCM2_RWCODE_INC_FEATURES & BCM2_RWCODE_LOAD
+	static string to_b64_data(const string& buf)
+	{
+		static const char chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+		string ret;
+
+		for (string::size_type i = 0; i < buf.size(); i += 3) {
+			uint32_t v = (buf[i] & 0xff) << 16;
+			if ((i + 1) < buf.size()) {
+				v |= (buf[i + 1] & 0xff) << 8;
+			}
+			if ((i + 2) < buf.size()) {
+				v |= (buf[i + 2] & 0xff);
+			}
+
+			ret += chars[(v >> 18) & 0x3f];
+			ret += chars[(v >> 12) & 0x3f];
+			ret += (i + 1) < buf.size() ? chars[(v >> 6) & 0x3f] : '=';
+			ret += (i + 2) < buf.size() ? chars[v & 0x3f] : '=';
+		}
+
+		return ret;
+	}
+
+	// uploads a small loader to the buffer area, which then receives the
+	// actual code in base64 encoding, and verifies it using crc16.
+	bool load_code(const string& code)
+	{
+		auto& cfg = interface()->resolved().codecfg();
+
+		if (!cfg.getline || !cfg.buffer || (cfg.buffer & 0xfff)
+				|| !interface()->version().get_opt_num("rwcode:loader", 1)) {
+			return false;
+		}
+
+		uint32_t loadaddr = interface()->profile()->kseg1() | cfg.buffer;
+
+		bcm2_load_args args = { ":%x", "\r\n", "#%x" };
+		args.buffer = h_to_be(m_loadaddr);
+		args.length = h_to_be(uint32_t(code.size()));
+		args.printf = h_to_be(cfg.printf);
+		args.getline = h_to_be(cfg.getline);
+
+		string loader = to_buf(args);
+		for (uint32_t word : mips_load_code) {
+			loader += to_buf(h_to_be(word));
+		}
+
+		upload_code(loadaddr, loader, false);
+
+		progress pg;
+		progress_init(&pg, m_loadaddr, code.size());
+
+		size_t window = interface()->resolved().get_opt_num(resolved_version::rwcode_write_window, 4);
+		vector<string> lines;
+		// pad to a multiple of 3, so we don't need base64 padding
+		string data = code + string((3 - code.size() % 3) % 3, '\0');
+
+		for (size_t i = 0; i < data.size(); i += 48) {
+			lines.push_back("@" + to_b64_data(data.substr(i, 48)));
+		}
+
+		try {
+			m_ram->exec(loadaddr + sizeof(args));
+
+			interface()->writeln_windowed(lines, window, [this, &code, &pg] (const string& line, size_t index) {
+				if (line[0] != ':') {
+					throw runtime_error("expected length, got '" + line + "'");
 				}
+
+				uint32_t expected = min((index + 1) * 48, code.size());
+				uint32_t actual = hex_cast<uint32_t>(line.substr(1));
+				if (actual != expected) {
+					throw runtime_error("expected length " + to_string(expected) + ", got " + to_string(actual));
+				}
+
+				if (m_prog_l) {
+					progress_set(&pg, m_loadaddr + actual - 1);
+					logger::i("\r ");
+					progress_print(&pg, stdout);
+				}
+
+				return true;
+			});
+
+			string line = trim(interface()->readln());
+			if (line.empty() || line[0] != '#') {
+				throw runtime_error("expected checksum, got '" + line + "'");
 			}
 
-			logger::i("\n");
+			uint16_t expected = crc16_ccitt(code);
+			uint16_t actual = hex_cast<uint16_t>(line.substr(1));
+
+			if (expected != actual) {
+				throw runtime_error("checksum mismatch: expected " + to_hex(expected) + ", got " + to_hex(actual));
+			}
+
+			interface()->wait_ready();
+			return true;
+		} catch (const exception& e) {
+			logger::d() << endl << "loader failed: " << e.what() << endl;
+			// terminates the loader, if it's still waiting for input
+			interface()->writeln();
+			interface()->wait_ready();
 		}
+
+		return false;
 	}
+#else
+	bool load_code(const string& code)
+	{ return false; }
+#endif
 
 	template<size_t N> void copy_patches(bcm2_patch (&dest)[N], const func& f, uint32_t kseg1)
 	{
@@ -1323,7 +2151,7 @@ class code_rwx : public parsing_rwx
 	{
 		auto profile = interface()->profile();
 		uint32_t kseg1 = profile->kseg1();
-		auto cfg = interface()->version().codecfg();
+		auto& cfg = interface()->resolved().codecfg();
 		auto funcs = interface()->version().functions(m_space.name());
 
 		auto fl_write = funcs["write"];
@@ -1340,17 +2168,25 @@ class code_rwx : public parsing_rwx
 			args.buffer = h_to_be(offset);
 			args.offset = 0;
 		} else {
-			args.buffer = h_to_be(kseg1 | cfg["buffer"]);
+			args.buffer = h_to_be(kseg1 | cfg.buffer);
 			args.offset = h_to_be(offset);
 		}
 
-		args.printf = h_to_be(cfg["printf"]);
+		args.printf = h_to_be(cfg.printf);
+
+		m_write_wide = false;
 
-		if (cfg["sscanf"] && cfg["getline"]) {
-			args.xscanf = h_to_be(cfg["sscanf"]);
-			args.getline = h_to_be(cfg["getline"]);
-		} else if (cfg["scanf"]) {
-			args.xscanf = h_to_be(cfg["scanf"]);
+		if (cfg.sscanf && cfg.getline) {
+			args.xscanf = h_to_be(cfg.sscanf);
+			args.getline = h_to_be(cfg.getline);
+
+			if ((BCM2_RWCODE_INC_FEATURES & BCM2_WRITE_WIDE)
+					&& interface()->version().get_opt_num("rwcode:write_wide", 1)) {
+				args.flags = h_to_be(be_to_h(args.flags) | BCM2_WRITE_WIDE);
+				m_write_wide = true;
+			}
+		} else if (cfg.scanf) {
+			args.xscanf = h_to_be(cfg.scanf);
 		}
 
 		if (fl_erase.addr()) {
@@ -1374,20 +2210,22 @@ class code_rwx : public parsing_rwx
 	{
 		auto profile = interface()->profile();
 		uint32_t kseg1 = profile->kseg1();
-		auto cfg = interface()->version().codecfg();
+		auto& cfg = interface()->resolved().codecfg();
 		auto funcs = interface()->version().functions(m_space.name());
 
 		auto fl_read = funcs["read"];
 
-		if (!cfg["printf"] || (!m_space.is_mem() && (!cfg["buffer"] || !fl_read.addr()))) {
+		if (!cfg.printf || (!m_space.is_mem() && (!cfg.buffer || !fl_read.addr()))) {
 			throw user_error("profile " + profile->name() + " does not support fast dump mode; use -s flag");
 		}
 
 		bcm2_read_args args = { ":%x", "\r\n" };
+		strcpy(args.str_fill, "~%x:%x");
+		strcpy(args.str_crc, "#%x");
 		args.length = h_to_be(length);
 		args.index = 0;
 		args.chunklen = h_to_be(limits_read().max);
-		args.printf = h_to_be(kseg1 | cfg["printf"]);
+		args.printf = h_to_be(kseg1 | cfg.printf);
 
 		if (m_space.is_mem()) {
 			args.buffer = h_to_be(offset);
@@ -1395,11 +2233,24 @@ class code_rwx : public parsing_rwx
 			args.fl_read = 0;
 		} else {
 			args.offset = h_to_be(offset);
-			args.buffer = h_to_be(kseg1 | cfg["buffer"]);
-			args.flags = h_to_be(fl_read.args());
+			args.buffer = h_to_be(kseg1 | cfg.buffer);
+			args.flags = fl_read.args();
 			args.fl_read = h_to_be(kseg1 | fl_read.addr());
 		}
 
+		m_read_enc = BCM2_READ_ENC_HEX;
+
+		if ((BCM2_RWCODE_INC_FEATURES & BCM2_READ_ENC_B64)
+				&& interface()->version().get_opt_str("rwcode:encoding", "b64") == "b64") {
+			m_read_enc = BCM2_READ_ENC_B64;
+		}
+
+		m_read_crc = (BCM2_RWCODE_INC_FEATURES & BCM2_READ_CRC)
+				&& interface()->version().get_opt_num("rwcode:crc", 1);
+
+		m_read_flags = args.flags | m_read_enc | (m_read_crc ? BCM2_READ_CRC : 0);
+		args.flags = h_to_be(m_read_flags);
+
 		copy_patches(args.patches, fl_read, kseg1);
 
 		return args;
@@ -1407,6 +2258,14 @@ class code_rwx : public parsing_rwx
 
 	uint32_t m_loadaddr = 0;
 	uint32_t m_entry = 0;
+	uint32_t m_read_enc = BCM2_READ_ENC_HEX;
+	bool m_read_crc = false;
+	uint32_t m_read_flags = 0;
+	uint32_t m_read_index = 0;
+	uint32_t m_read_length = 0;
+	uint32_t m_chunk_crc = 0;
+	bool m_have_chunk_crc = false;
+	bool m_write_wide = false;
 
 	bool m_write = false;
 	uint32_t m_rw_offset = 0;
@@ -1481,12 +2340,11 @@ string bfc_cmcfg::parse_chunk_line(const string& line, uint32_t)
 			break;
 		}
 
-		try {
-			linebuf += hex_cast<int>(line.substr(offset, 2));
-		} catch (const bad_lexical_cast& e) {
-			if (line.size() == 73) {
-				throw e;
-			}
+		uint32_t val;
+		if (parse_hex_u32(line.data() + offset, line.data() + offset + 2, val) == 2) {
+			linebuf += char(val);
+		} else if (line.size() == 73) {
+			throw bad_lexical_cast("invalid hex byte at " + to_string(offset) + " in '" + line + "'");
 		}
 	}
 
@@ -1510,7 +2368,7 @@ class bfc_bootassist : public rwx
 		rwx::set_interface(intf);
 		m_ram = rwx::create(intf, "ram");
 
-		auto v = intf->version();
+		auto& v = intf->version();
 		m_cpuc_reg_request = v.get_opt_num("bootassist:cpuc_reg_request", 0xd3800044);
 		m_mbox_reg_cmstate = v.get_opt_num("bootassist:mbox_reg_cmstate", 0xd3800084);
 		m_mbox_reg_imgreq = v.get_opt_num("bootassist:mbox_reg_imgreq", 0xd3800090);
@@ -1607,6 +2465,7 @@ class bfc_bootassist : public rwx
 unsigned rwx::s_count = 0;
 sigh_type rwx::s_sighandler_orig = nullptr;
 volatile sig_atomic_t rwx::s_sigint = 0;
+bool rwx::s_sigint_sticky = false;
 
 rwx::rwx()
 {
@@ -1675,7 +2534,14 @@ void rwx::dump(uint32_t offset, uint32_t length, std::ostream& os, bool resume)
 		m_space.check_range(offset, length);
 	}
 
-	if (resume) {
+	if (resume && m_journal && !m_journal->empty()) {
+		if (m_journal->completed_until(offset) >= (offset + length)) {
+			logger::i() << "nothing to resume" << endl;
+			return;
+		}
+
+		logger::v() << "resuming from journal" << endl;
+	} else if (resume) {
 		uint32_t completed = get_stream_size(os);
 		if (completed >= length) {
 			logger::i() << "nothing to resume" << endl;
@@ -1698,16 +2564,101 @@ void rwx::dump(uint32_t offset, uint32_t length, std::ostream& os, bool resume)
 	}
 
 	do_init(offset_r, length_r, false);
+
+	vector<uint32_t> hashes;
+	uint32_t reused = 0;
+
+	if (m_reference) {
+		logger::v() << "calculating checksums" << endl;
+		hashes = hash_chunks(offset_r, length_r);
+		if (hashes.empty()) {
+			logger::i() << "target does not support checksums; ignoring reference" << endl;
+		}
+	}
+
+	// reference checksums are calculated for chunks of the maximum size
+	bool adaptive = adaptive_chunks() && hashes.empty()
+			&& m_intf->resolved().get_opt_num(resolved_version::rwx_adaptive_readsize, 1);
+	string tuner_key;
+	uint32_t tuner_initial = 0;
+
+	if (adaptive) {
+		tuner_key = chunk_size_key(m_intf, m_space);
+		tuner_initial = load_chunk_size(tuner_key);
+	}
+
+	chunk_tuner tuner(limits_read(), tuner_initial);
+	if (adaptive && tuner_initial) {
+		logger::d() << "using chunk size " << tuner.size() << endl;
+	}
+
 	init_progress(offset_r, length_r, false);
 
 	bool show_hdr = true;
+	bool hole = false;
+	// set once chunks are prefetched
+	bool pipelined = false;
 	string hdrbuf;
 
-	while (length_r) {
+	for (size_t i = 0; length_r; ++i) {
 		throw_if_interrupted();
 
-		uint32_t n = min(length_r, limits_read().max);
-		string chunk = read_chunk(offset_r, n);
+		uint32_t chunk_size = adaptive ? tuner.size() : limits_read().max;
+		uint32_t n = min(length_r, chunk_size);
+		string chunk;
+
+		if (m_journal) {
+			// the part of this chunk that ends up in the output
+			uint32_t begin = max(offset_r, offset);
+			uint32_t end = min(offset_r + n, offset + length);
+
+			if (begin < end && m_journal->completed_until(begin) >= end) {
+				os.seekp(end - begin, ios::cur);
+				update_progress(offset_r + n, n);
+				hole = false;
+				show_hdr = false;
+				length_w -= (end - begin);
+				length_r -= n;
+				offset_r += n;
+				continue;
+			}
+		}
+
+		if (i < hashes.size() && offset_r >= offset) {
+			string ref(n, '\0');
+			m_reference->clear();
+
+			if (m_reference->seekg(offset_r - offset) && m_reference->read(&ref[0], n)
+					&& crc32(ref) == hashes[i]) {
+				update_progress(offset_r + n, n);
+				chunk = ref;
+				++reused;
+			}
+		}
+
+		for (uint32_t offset_p = offset_r, length_p = length_r; hashes.empty() && length_p; ) {
+			uint32_t n_p = min(length_p, chunk_size);
+			if (!prefetch_chunk(offset_p, n_p)) {
+				break;
+			}
+
+			pipelined = true;
+			offset_p += n_p;
+			length_p -= n_p;
+		}
+
+		if (chunk.empty()) {
+			unsigned retries = m_retries;
+			mstimer timer;
+			chunk = read_chunk(offset_r, n);
+
+			// the time it takes to read a prefetched chunk says little
+			// about its size, and changing the size would invalidate all
+			// chunks in the pipeline, so the size is kept as it is.
+			if (adaptive && !pipelined && n == chunk_size) {
+				tuner.update(n, timer.elapsed(), m_retries - retries);
+			}
+		}
 
 		if (offset_r > (offset + length)) {
 			update_progress(offset + length - 2, 0);
@@ -1732,7 +2683,21 @@ void rwx::dump(uint32_t offset, uint32_t length, std::ostream& os, bool resume)
 			chunk_w = chunk.substr(0, min(n, length_w));
 		}
 
-		os.write(chunk_w.data(), chunk_w.size());
+		if (m_sparse && !chunk_w.empty() && chunk_w.find_first_not_of('\0') == string::npos) {
+			// leave a hole in the output file. chunks filled with 0xff
+			// must still be written, as holes read back as zeroes.
+			os.seekp(chunk_w.size(), ios::cur);
+			hole = true;
+		} else {
+			os.write(chunk_w.data(), chunk_w.size());
+			hole = false;
+		}
+
+		if (m_journal) {
+			// make sure the data is on disk before it's marked as completed
+			os.flush();
+			m_journal->add(max(offset_r, offset), chunk_w);
+		}
 
 		if (show_hdr) {
 			if (hdrbuf.size() < sizeof(ps_header)) {
@@ -1754,6 +2719,21 @@ void rwx::dump(uint32_t offset, uint32_t length, std::ostream& os, bool resume)
 		length_r -= n;
 		offset_r += n;
 	}
+
+	if (hole) {
+		// extend the file to its full size
+		os.seekp(-1, ios::cur);
+		os.put('\0');
+	}
+
+	// don't save a size that may be lower because of a transient error
+	if (adaptive && tuner.best() && !tuner.retried()) {
+		save_chunk_size(tuner_key, tuner.best());
+	}
+
+	if (!hashes.empty()) {
+		logger::v() << endl << "reused " << reused << " of " << hashes.size() << " chunks from reference" << endl;
+	}
 }
 
 void rwx::dump(const string& spec, ostream& os, bool resume)
@@ -1764,6 +2744,167 @@ void rwx::dump(const string& spec, ostream& os, bool resume)
 	return dump(offset, length, os, resume);
 }
 
+void rwx::parse_spec(const string& spec, uint32_t& offset, uint32_t& length, bool write)
+{
+	parse_offset_size(*this, spec, offset, length, write);
+}
+
+void rwx::foreach_hash(uint32_t offset, uint32_t length, const hash_handler& f)
+{
+	require_capability(cap_read);
+
+	if (capabilities() & cap_special) {
+		throw invalid_argument("hashing not supported with special reader");
+	}
+
+	m_space.check_range(offset, length);
+	auto cleaner = make_cleaner();
+
+	uint32_t offset_r = align_left(offset, limits_read().alignment);
+	uint32_t length_r = align_right(length + (offset - offset_r), limits_read().min);
+
+	do_init(offset_r, length_r, false);
+	vector<uint32_t> hashes = hash_chunks(offset_r, length_r);
+	if (hashes.empty()) {
+		logger::d() << "target does not support checksums; reading data" << endl;
+	}
+
+	init_progress(offset_r, length_r, false);
+
+	for (size_t i = 0; length_r; ++i) {
+		throw_if_interrupted();
+
+		uint32_t n = min(length_r, limits_read().max);
+		uint32_t begin = max(offset, offset_r);
+		uint32_t end = min(offset + length, offset_r + n);
+
+		auto read = [this, offset_r, n, begin, end] () {
+			string chunk = read_chunk(offset_r, n);
+			if (chunk.size() != n) {
+				throw runtime_error("unexpected chunk length: " + to_string(chunk.size()));
+			}
+
+			return chunk.substr(begin - offset_r, end - begin);
+		};
+
+		// checksums of partial chunks at the beginning or end
+		// of the range are of no use.
+		if (i < hashes.size() && begin == offset_r && end == (offset_r + n)) {
+			update_progress(offset_r + n, n);
+			f(begin, end - begin, &hashes[i], read);
+		} else {
+			f(begin, end - begin, nullptr, read);
+		}
+
+		length_r -= n;
+		offset_r += n;
+	}
+}
+
+uint32_t rwx::hash(uint32_t offset, uint32_t length)
+{
+	uint32_t crc = 0;
+
+	foreach_hash(offset, length, [&crc] (uint32_t offset, uint32_t length, const uint32_t* chunk_crc, const function<string()>& read) {
+		crc = crc32_combine(crc, chunk_crc ? *chunk_crc : crc32(read()), length);
+	});
+
+	return crc;
+}
+
+uint32_t rwx::hash(const string& spec)
+{
+	require_capability(cap_read);
+	uint32_t offset, length;
+	parse_offset_size(*this, spec, offset, length, false);
+	return hash(offset, length);
+}
+
+vector<pair<uint32_t, uint32_t>> rwx::diff(uint32_t offset, const string& buf)
+{
+	vector<pair<uint32_t, uint32_t>> ret;
+
+	foreach_hash(offset, buf.size(), [&] (uint32_t offset_c, uint32_t length, const uint32_t* crc, const function<string()>& read) {
+		string expected = buf.substr(offset_c - offset, length);
+		if (crc && *crc == crc32(expected)) {
+			return;
+		}
+
+		string actual = read();
+
+		for (uint32_t i = 0; i < length; ++i) {
+			if (actual[i] == expected[i]) {
+				continue;
+			} else if (!ret.empty() && (ret.back().first + ret.back().second) == (offset_c + i)) {
+				++ret.back().second;
+			} else {
+				ret.emplace_back(offset_c + i, 1);
+			}
+		}
+	});
+
+	return ret;
+}
+
+vector<pair<uint32_t, uint32_t>> rwx::diff(const string& spec, istream& is)
+{
+	uint32_t offset, length;
+	parse_offset_size(*this, spec, offset, length, true);
+
+	if (!length) {
+		length = get_stream_size(is);
+	}
+
+	string buf(length, '\0');
+	if (!is.read(&buf[0], length)) {
+		throw runtime_error("failed to read " + to_string(length) + " bytes");
+	}
+
+	return diff(offset, buf);
+}
+
+set<uint32_t> rwx::changed_blocks(uint32_t offset, const string& buf, uint32_t blocksize)
+{
+	set<uint32_t> blocks;
+
+	foreach_hash(offset, buf.size(), [&] (uint32_t offset_c, uint32_t length, const uint32_t* crc, const function<string()>& read) {
+		uint32_t first = align_left(offset_c, blocksize);
+		uint32_t last = align_left(offset_c + length - 1, blocksize);
+		bool known = true;
+
+		for (uint32_t block = first; known && block <= last; block += blocksize) {
+			known = blocks.count(block);
+		}
+
+		if (known) {
+			return;
+		}
+
+		string expected = buf.substr(offset_c - offset, length);
+		if (crc) {
+			if (*crc == crc32(expected)) {
+				return;
+			} else if (first == last) {
+				blocks.insert(first);
+				return;
+			}
+		}
+
+		string actual = read();
+
+		for (uint32_t block = first; block <= last; block += blocksize) {
+			uint32_t begin = max(block, offset_c) - offset_c;
+			uint32_t end = min(block + blocksize, offset_c + length) - offset_c;
+
+			if (actual.compare(begin, end - begin, expected, begin, end - begin)) {
+				blocks.insert(block);
+			}
+		}
+	});
+
+	return blocks;
+}
+
 string rwx::read(uint32_t offset, uint32_t length)
 {
 	ostringstream ostr;
@@ -1806,6 +2947,43 @@ void rwx::write(uint32_t offset, const string& buf, uint32_t length)
 		length = buf.size();
 	}
 
+	if (!m_incremental) {
+		write_range(offset, buf, length);
+		return;
+	}
+
+	require_capability(cap_read);
+
+	uint32_t blocksize = m_space.blocksize();
+	if (!blocksize) {
+		if (!m_space.is_mem()) {
+			throw user_error("eraseblock size of " + m_space.name() + " is unknown; cannot use incremental write");
+		}
+
+		blocksize = limits_write().max;
+	}
+
+	set<uint32_t> blocks = changed_blocks(offset, buf.substr(0, length), blocksize);
+
+	if (blocks.empty()) {
+		logger::i() << "contents match; nothing to write" << endl;
+		return;
+	}
+
+	logger::i() << "writing " << blocks.size() << " changed block(s)" << endl;
+
+	for (uint32_t block : blocks) {
+		// the range's ends are not necessarily aligned to blocksize
+		uint32_t begin = max(block, offset);
+		uint32_t end = min(block + blocksize, offset + length);
+
+		logger::v() << "writing block 0x" << to_hex(block) << endl;
+		write_range(begin, buf.substr(begin - offset, end - begin), end - begin);
+	}
+}
+
+void rwx::write_range(uint32_t offset, const string& buf, uint32_t length)
+{
 	m_space.check_range(offset, length);
 
 	limits lim = limits_write();
@@ -1824,6 +3002,14 @@ void rwx::write(uint32_t offset, const string& buf, uint32_t length)
 		contents = read(offset_w, length_w);
 	}
 
+	// if chunks aren't written individually, only the whole range
+	// can be skipped.
+	bool committed = write_chunks_committed();
+	if (m_journal && m_journal->completed_until(offset_w) >= (offset_w + length_w)) {
+		logger::v() << "skipping completed range 0x" << to_hex(offset_w) << "," << length_w << endl;
+		return;
+	}
+
 	auto cleaner = make_cleaner();
 	do_init(offset_w, length_w, true);
 	init_progress(offset_w, length_w, true);
@@ -1855,7 +3041,9 @@ void rwx::write(uint32_t offset, const string& buf, uint32_t length)
 		//string chunk(buf_w.substr(buf_w.size() - length_w, n));
 		string chunk(buf_w.substr(begin, n));
 
-		if (contents.empty() || contents.substr(begin, n) != chunk) {
+		bool skip = committed && m_journal && m_journal->completed_until(offset_w) >= (offset_w + n);
+
+		if (!skip && (contents.empty() || contents.substr(begin, n) != chunk)) {
 			bool ok = false;
 
 			while (!ok) {
@@ -1885,6 +3073,10 @@ void rwx::write(uint32_t offset, const string& buf, uint32_t length)
 					retries = 0;
 				}
 			}
+
+			if (committed && m_journal) {
+				m_journal->add(offset_w, chunk);
+			}
 		}
 
 		if (offset_w < offset) {
@@ -1900,6 +3092,10 @@ void rwx::write(uint32_t offset, const string& buf, uint32_t length)
 		length_w -= n;
 	}
 
+	if (!committed && m_journal) {
+		m_journal->add(offset_w - buf_w.size(), buf_w);
+	}
+
 	update_progress(offset_w, length_w);
 }
 
@@ -21,7 +21,10 @@
 #define BCM2DUMP_DUMPER_H
 #include <memory>
 #include <string>
+#include <vector>
+#include <set>
 #include "interface.h"
+#include "journal.h"
 #include "profile.h"
 #include "ps.h"
 
@@ -65,6 +68,17 @@ class rwx //: public rwx_writer
 	void dump(uint32_t offset, uint32_t length, std::ostream& os, bool resume = false);
 	std::string read(uint32_t offset, uint32_t length);
 
+	// returns the crc32 of the specified range. if supported by the
+	// target, the data itself is not transferred.
+	uint32_t hash(const std::string& spec);
+	uint32_t hash(uint32_t offset, uint32_t length);
+
+	// compares the specified range with the given data, and returns all
+	// ranges (offset, length) that differ. if supported by the target, only
+	// chunks with mismatching checksums are transferred.
+	std::vector<std::pair<uint32_t, uint32_t>> diff(const std::string& spec, std::istream& is);
+	std::vector<std::pair<uint32_t, uint32_t>> diff(uint32_t offset, const std::string& buf);
+
 	uint32_t read32(uint32_t offset)
 	{ return read_num<uint32_t>(offset); }
 
@@ -79,6 +93,10 @@ class rwx //: public rwx_writer
 
 	//bool imgscan(uint32_t offset, uint32_t length, uint32_t steps, ps_header& hdr);
 
+	// parses a {<partition>[+<off>],<off>}[,<size>] argument, and
+	// sets the partition accordingly.
+	void parse_spec(const std::string& spec, uint32_t& offset, uint32_t& length, bool write = false);
+
 	static sp create(const interface::sp& interface, const std::string& type, bool safe = true);
 	static sp create_special(const interface::sp& intf, const std::string& type);
 
@@ -91,6 +109,9 @@ class rwx //: public rwx_writer
 	virtual void set_partition(const addrspace::part& partition)
 	{ m_partition = partition; }
 
+	virtual const addrspace::part& partition() const
+	{ return m_partition; }
+
 	virtual void set_interface(const interface::sp& intf)
 	{ m_intf = intf; }
 
@@ -103,9 +124,39 @@ class rwx //: public rwx_writer
 	virtual void silent(bool silent) final
 	{ m_silent = silent; }
 
+	// if set, dump() compares the crc32 of each chunk with the
+	// corresponding data in this stream, and transfers only those
+	// chunks that differ. requires target support.
+	virtual void set_reference(std::istream* is)
+	{ m_reference = is; }
+
+	// if set, dump() and write() record each completed chunk in the
+	// journal, and skip chunks that the journal lists as completed.
+	virtual void set_journal(const journal::sp& j)
+	{ m_journal = j; }
+
+	// if set, write() only writes eraseblocks whose contents differ
+	// from the data to be written.
+	virtual void incremental(bool incremental) final
+	{ m_incremental = incremental; }
+
+	// if set, dump() seeks past chunks that consist of zeroes only,
+	// instead of writing them. requires a seekable output stream.
+	virtual void sparse(bool sparse) final
+	{ m_sparse = sparse; }
+
 	static bool was_interrupted()
 	{ return s_sigint; }
 
+	// sets (or clears) the flag that is otherwise set by SIGINT
+	static void set_interrupted(bool interrupted)
+	{ s_sigint = interrupted; }
+
+	// if set, the flag isn't cleared once an interrupted exception has been
+	// thrown, so that all sessions of a parallel dump are interrupted.
+	static void set_interrupt_sticky(bool sticky)
+	{ s_sigint_sticky = sticky; }
+
 	protected:
 	void require_capability(unsigned cap);
 
@@ -135,6 +186,26 @@ class rwx //: public rwx_writer
 	virtual std::string read_special(uint32_t offset, uint32_t length) = 0;
 
 	virtual std::string read_chunk(uint32_t offset, uint32_t length) = 0;
+	// announces that the chunk at `offset` will be read after all previously
+	// announced chunks. before each call to read_chunk(), the upcoming chunks
+	// are announced in order, starting with the one about to be read, until
+	// this function returns false. chunks may thus be announced repeatedly.
+	virtual bool prefetch_chunk(uint32_t offset, uint32_t length)
+	{ return false; }
+	// calculates the crc32 of each chunk (as returned by read_chunk()) in
+	// the specified range, without transferring the data. returns an empty
+	// vector if this is not supported.
+	virtual std::vector<uint32_t> hash_chunks(uint32_t offset, uint32_t length)
+	{ return {}; }
+	// returns true if read_chunk() accepts any multiple of limits_read().min, up
+	// to limits_read().max. if so, dump() adjusts the chunk size, based on
+	// the observed throughput and number of retries.
+	virtual bool adaptive_chunks() const
+	{ return false; }
+	// returns false if the data passed to write_chunk() is only written to
+	// its destination once the last chunk of the range has been written.
+	virtual bool write_chunks_committed() const
+	{ return true; }
 	// chunk length is guaranteed to be either min_length_write() or max_length_write()
 	virtual bool write_chunk(uint32_t offset, const std::string& chunk)
 	{ return false; }
@@ -145,7 +216,9 @@ class rwx //: public rwx_writer
 	static void throw_if_interrupted()
 	{
 		if (was_interrupted()) {
-			s_sigint = 0;
+			if (!s_sigint_sticky) {
+				s_sigint = 0;
+			}
 			throw interrupted();
 		}
 	}
@@ -177,6 +250,10 @@ class rwx //: public rwx_writer
 	interface::sp m_intf;
 	progress_listener m_prog_l;
 	image_listener m_img_l;
+	std::istream* m_reference = nullptr;
+	journal::sp m_journal;
+	// number of chunks that had to be read again
+	unsigned m_retries = 0;
 	addrspace::part m_partition;
 	addrspace m_space;
 
@@ -199,6 +276,19 @@ class rwx //: public rwx_writer
 	{ return scoped_cleaner(this); }
 
 	private:
+	typedef std::function<void(uint32_t, uint32_t, const uint32_t*, const std::function<std::string()>&)> hash_handler;
+	// calls `f` for each part of the range that lies within a single chunk,
+	// passing its offset, length, and crc32 (nullptr if not calculated by
+	// the target). the last argument reads and returns the data.
+	void foreach_hash(uint32_t offset, uint32_t length, const hash_handler& f);
+	// returns the blocks (of size `blocksize`) whose contents differ from
+	// `buf`. data is only read if the target doesn't calculate checksums, or
+	// if a chunk spans more than one block, and never for chunks that lie
+	// within blocks that are already known to differ.
+	std::set<uint32_t> changed_blocks(uint32_t offset, const std::string& buf, uint32_t blocksize);
+
+	void write_range(uint32_t offset, const std::string& buf, uint32_t length);
+
 	// XXX for now, we always assume big-endian!
 	template<class T> void write_num(uint32_t offset, T value)
 	{ write(offset, to_buf(h_to_be(value))); }
@@ -211,10 +301,13 @@ class rwx //: public rwx_writer
 
 	bool m_inited = false;
 	bool m_silent = false;
+	bool m_sparse = false;
+	bool m_incremental = false;
 
 	static unsigned s_count;
 	static sigh_type s_sighandler_orig;
 	static volatile sig_atomic_t s_sigint;
+	static bool s_sigint_sticky;
 };
 
 }
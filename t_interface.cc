@@ -0,0 +1,222 @@
+/**
+ * bcm2-utils
+ * Copyright (C) 2016 Joseph C. Lehner <joseph.c.lehner@gmail.com>
+ *
+ * bcm2-utils is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bcm2-utils is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with bcm2-utils.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <iostream>
+#include <deque>
+#include "interface.h"
+#include "util.h"
+using namespace std;
+using namespace bcm2dump;
+
+namespace {
+
+class failed_test : public runtime_error
+{
+	public:
+	explicit failed_test(const string& msg) : runtime_error(msg) {}
+	failed_test(const string& msg, const exception& e)
+	: failed_test(msg + ":\n" + e.what()) {}
+};
+
+// a target that (optionally) echoes each line it receives, followed by
+// the response returned by `m_respond`. like the serial implementation,
+// writeln() consumes the echo.
+class mock_io : public io
+{
+	public:
+	mock_io(bool echo, function<string(const string&)> respond)
+	: m_echo(echo), m_respond(respond) {}
+
+	virtual int getc() override
+	{
+		if (m_out.empty()) {
+			return eof;
+		}
+
+		int c = m_out.front() & 0xff;
+		m_out.pop_front();
+		return c;
+	}
+
+	virtual string read(size_t length, bool partial = true) override
+	{
+		string ret;
+		while (!m_out.empty() && ret.size() < length) {
+			ret += char(getc());
+		}
+		return ret;
+	}
+
+	virtual void writeln(const string& str = "") override
+	{
+		write(str + "\r\n");
+		if (m_echo) {
+			consume_echo(100);
+		}
+	}
+
+	virtual void write(const string& str) override
+	{
+		for (char c : str) {
+			if (c == '\r' || c == '\n') {
+				if (!m_in.empty()) {
+					received.push_back(m_in);
+					if (m_echo) {
+						m_out.insert(m_out.end(), m_in.begin(), m_in.end());
+						m_out.insert(m_out.end(), { '\r', '\n' });
+					}
+
+					string response = m_respond(m_in);
+					m_out.insert(m_out.end(), response.begin(), response.end());
+					m_in.clear();
+				}
+			} else {
+				m_in += c;
+			}
+		}
+	}
+
+	virtual bool pending(unsigned timeout = 100) override
+	{ return !m_out.empty(); }
+
+	vector<string> received;
+
+	private:
+	bool m_echo;
+	function<string(const string&)> m_respond;
+	string m_in;
+	deque<char> m_out;
+};
+
+class mock_interface : public cmdline_interface
+{
+	public:
+	virtual string name() const override
+	{ return "mock"; }
+
+	virtual bcm2_interface id() const override
+	{ return BCM2_INTF_NONE; }
+
+	virtual bool is_ready(bool passive = false) override
+	{ return true; }
+
+	protected:
+	virtual bool check_for_prompt(const string& line) const override
+	{ return false; }
+};
+
+// responds to each line with ":<index>", like mips_write() with wide lines
+string ack_index(const string& line)
+{
+	return ":" + to_hex(lexical_cast<uint32_t>(line.substr(0, line.find(':')), 16)) + "\r\n";
+}
+
+vector<string> make_lines(size_t count)
+{
+	vector<string> lines;
+	for (size_t i = 0; i < count; ++i) {
+		lines.push_back(to_hex(i) + ":deadbeef:" + to_hex(i * 4, 8));
+	}
+	return lines;
+}
+
+void test_writeln_windowed(bool echo, size_t window)
+{
+	string name = "writeln_windowed (echo=" + to_string(echo) + ", window=" + to_string(window) + ")";
+	auto io = make_shared<mock_io>(echo, &ack_index);
+	mock_interface intf;
+
+	if (!intf.is_active(io)) {
+		throw failed_test(name + ": interface not active");
+	}
+
+	auto lines = make_lines(10);
+	vector<size_t> acked;
+
+	try {
+		intf.writeln_windowed(lines, window, [&acked] (const string& line, size_t index) {
+			if (line[0] != ':' || line.find(':', 1) != string::npos) {
+				throw runtime_error("unexpected line '" + line + "'");
+			} else if (lexical_cast<uint32_t>(line.substr(1), 16) != index) {
+				throw runtime_error("expected ack of line " + to_string(index) + ", got '" + line + "'");
+			}
+
+			acked.push_back(index);
+			return true;
+		});
+	} catch (const exception& e) {
+		throw failed_test(name, e);
+	}
+
+	if (io->received != lines) {
+		throw failed_test(name + ": target received " + to_string(io->received.size())
+				+ " lines, expected " + to_string(lines.size()));
+	}
+
+	for (size_t i = 0; i < lines.size(); ++i) {
+		if (i >= acked.size() || acked[i] != i) {
+			throw failed_test(name + ": line " + to_string(i) + " not acknowledged in order");
+		}
+	}
+
+	cout << "OK " << name << endl;
+}
+
+void test_writeln_windowed_bad_ack(bool echo, size_t window)
+{
+	string name = "writeln_windowed bad ack (echo=" + to_string(echo) + ", window=" + to_string(window) + ")";
+	auto io = make_shared<mock_io>(echo, [] (const string& line) {
+		return string(":ffff\r\n");
+	});
+	mock_interface intf;
+	intf.is_active(io);
+
+	try {
+		intf.writeln_windowed(make_lines(4), window, [] (const string& line, size_t index) {
+			if (lexical_cast<uint32_t>(line.substr(1), 16) != index) {
+				throw runtime_error("bad ack");
+			}
+			return true;
+		});
+	} catch (const exception& e) {
+		cout << "OK " << name << endl;
+		return;
+	}
+
+	throw failed_test(name + ": expected exception");
+}
+}
+
+int main()
+{
+	try {
+		for (bool echo : { false, true }) {
+			for (size_t window : { 0, 1, 4, 16 }) {
+				test_writeln_windowed(echo, window);
+			}
+
+			test_writeln_windowed_bad_ack(echo, 4);
+		}
+	} catch (const exception& e) {
+		cerr << "TEST FAILED" << endl << e.what() << endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -17,7 +17,16 @@
  *
  */
 
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
 #include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
 #include "profile.h"
 #include "util.h"
 using namespace std;
@@ -75,40 +84,108 @@ bool is_unescaped(const string& str, string::size_type pos)
 //
 // we don't care if the operations on the ofstream's buffer fail,
 // as this is expected if we're not using a logfile!
+//
+// each thread has its own logbuf, which collects output until a line is
+// complete, or the stream is flushed. it's then written to the log file,
+// and to `os` (if not null), while holding `lock`, so that the sessions of
+// a parallel dump can log at the same time.
 
 class logbuf : public streambuf
 {
 	public:
-	logbuf(ostream& os)
+	logbuf(ostream* os)
 	: m_os(os)
 	{}
 
+	~logbuf()
+	{ write_buf(); }
+
 	static ofstream file;
+	static mutex lock;
 
 	protected:
 	virtual int overflow(int c) override
 	{
-		file.rdbuf()->sputc(c);
-		return m_os.rdbuf()->sputc(c);
+		if (c != traits_type::eof()) {
+			m_buf += traits_type::to_char_type(c);
+			if (c == '\n') {
+				write_buf();
+			}
+		}
+
+		return traits_type::not_eof(c);
+	}
+
+	virtual streamsize xsputn(const char* s, streamsize n) override
+	{
+		m_buf.append(s, n);
+		if (memchr(s, '\n', n)) {
+			write_buf();
+		}
+
+		return n;
 	}
 
 	virtual int sync() override
 	{
-		file.rdbuf()->pubsync();
-		return m_os.rdbuf()->pubsync();
+		write_buf(true);
+		return 0;
 	}
 
 	private:
-	ostream& m_os;
+	void write_buf(bool sync = false)
+	{
+		if (m_buf.empty() && !sync) {
+			return;
+		} else if (!m_os && !file.is_open()) {
+			// the log file is only opened before any threads are started
+			m_buf.clear();
+			return;
+		}
+
+		lock_guard<mutex> guard(lock);
+		file.rdbuf()->sputn(m_buf.data(), m_buf.size());
+		if (m_os) {
+			m_os->rdbuf()->sputn(m_buf.data(), m_buf.size());
+		}
+
+		if (sync) {
+			file.rdbuf()->pubsync();
+			if (m_os) {
+				m_os->rdbuf()->pubsync();
+			}
+		}
+
+		m_buf.clear();
+	}
+
+	ostream* m_os;
+	string m_buf;
 };
 
 ofstream logbuf::file;
+mutex logbuf::lock;
 
-ostream log_cout(new logbuf(cout));
-ostream log_cerr(new logbuf(cerr));
+struct logstream
+{
+	logstream(ostream* os) : buf(os), os(&buf) {}
+
+	logbuf buf;
+	ostream os;
+};
+
+// per thread, so that the stream state isn't shared either
+thread_local logstream log_cout(&cout);
+thread_local logstream log_cerr(&cerr);
+thread_local logstream log_file(nullptr);
 }
 
 string trim(string str)
+{
+	return trim_in_place(str);
+}
+
+string& trim_in_place(string& str)
 {
 	if (str.empty()) {
 		return str;
@@ -121,15 +198,14 @@ string trim(string str)
 
 	i = str.find_first_not_of(" \r\n\t");
 	if (i == string::npos) {
-		return "";
+		str.clear();
+		return str;
 	}
 
-	str = str.substr(i);
+	str.erase(0, i);
 
 	// strip embedded carriage returns
-	while ((i = str.find('\r')) != string::npos) {
-		str.erase(i, 1);
-	}
+	str.erase(remove(str.begin(), str.end(), '\r'), str.end());
 
 	return str;
 }
@@ -159,6 +235,128 @@ vector<string> split(const string& str, char delim, bool empties, size_t limit)
 	return subs;
 }
 
+namespace {
+uint32_t gf2_matrix_times(const uint32_t* mat, uint32_t vec)
+{
+	uint32_t sum = 0;
+
+	for (; vec; vec >>= 1, ++mat) {
+		if (vec & 1) {
+			sum ^= *mat;
+		}
+	}
+
+	return sum;
+}
+
+void gf2_matrix_square(uint32_t* square, const uint32_t* mat)
+{
+	for (unsigned i = 0; i < 32; ++i) {
+		square[i] = gf2_matrix_times(mat, mat[i]);
+	}
+}
+}
+
+// this is the algorithm used by zlib's crc32_combine()
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, uint64_t len2)
+{
+	if (!len2) {
+		return crc1;
+	}
+
+	uint32_t even[32];
+	uint32_t odd[32];
+
+	// operator for one zero bit
+	odd[0] = 0xedb88320;
+	for (unsigned i = 1, row = 1; i < 32; ++i, row <<= 1) {
+		odd[i] = row;
+	}
+
+	// operators for two and four zero bits
+	gf2_matrix_square(even, odd);
+	gf2_matrix_square(odd, even);
+
+	// apply len2 zero bytes to crc1
+	do {
+		gf2_matrix_square(even, odd);
+		if (len2 & 1) {
+			crc1 = gf2_matrix_times(even, crc1);
+		}
+
+		len2 >>= 1;
+		if (!len2) {
+			break;
+		}
+
+		gf2_matrix_square(odd, even);
+		if (len2 & 1) {
+			crc1 = gf2_matrix_times(odd, crc1);
+		}
+
+		len2 >>= 1;
+	} while (len2);
+
+	return crc1 ^ crc2;
+}
+
+const int8_t hex_digit_values[256] = {
+#define X16 -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+	X16, X16, X16,
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 9, -1, -1, -1, -1, -1, -1,
+	-1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	X16,
+	-1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	X16, X16, X16, X16, X16, X16, X16, X16, X16,
+#undef X16
+};
+
+bool parse_integer(const char*& p, const char* end, unsigned base, uint64_t max,
+		uint64_t max_neg, bool& negative, uint64_t& magnitude)
+{
+	while (p != end && isspace(*p & 0xff)) {
+		++p;
+	}
+
+	negative = false;
+	magnitude = 0;
+
+	if (p != end && (*p == '+' || *p == '-')) {
+		negative = (*p++ == '-');
+	}
+
+	bool digits = false;
+
+	if (base == 16 && p != end && *p == '0') {
+		++p;
+		if (p != end && (*p == 'x' || *p == 'X')) {
+			++p;
+		} else {
+			digits = true;
+		}
+	}
+
+	uint64_t limit = negative ? max_neg : max;
+	bool overflow = false;
+
+	for (; p != end; ++p) {
+		int digit = hex_digit(*p);
+		if (digit < 0 || unsigned(digit) >= base) {
+			break;
+		}
+
+		if (magnitude > (limit - digit) / base) {
+			overflow = true;
+		} else {
+			magnitude = magnitude * base + digit;
+		}
+
+		digits = true;
+	}
+
+	return digits && !overflow;
+}
+
 string to_hex(const std::string& buffer)
 {
 	string ret;
@@ -225,6 +423,42 @@ std::string escape(string str, bool escape_quote)
 	return str;
 }
 
+string cache_filename(const string& name)
+{
+#ifdef _WIN32
+	const char* base = getenv("LOCALAPPDATA");
+	if (!base || !*base) {
+		return "";
+	}
+
+	string dir = string(base) + "\\bcm2dump";
+	if (_mkdir(dir.c_str()) != 0 && errno != EEXIST) {
+		return "";
+	}
+
+	return dir + "\\" + name;
+#else
+	string dir;
+	const char* base = getenv("XDG_CACHE_HOME");
+
+	if (base && *base) {
+		dir = base;
+	} else if ((base = getenv("HOME")) && *base) {
+		dir = string(base) + "/.cache";
+		mkdir(dir.c_str(), 0755);
+	} else {
+		return "";
+	}
+
+	dir += "/bcm2dump";
+	if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+		return "";
+	}
+
+	return dir + "/" + name;
+#endif
+}
+
 int logger::s_loglevel = logger::info;
 bool logger::s_no_stdout = false;
 list<string> logger::s_lines;
@@ -239,11 +473,11 @@ constexpr int logger::err;
 ostream& logger::log(int severity)
 {
 	if (severity < s_loglevel) {
-		return logbuf::file;
+		return log_file.os;
 	} else if (s_no_stdout || severity >= warn) {
-		return log_cerr;
+		return log_cerr.os;
 	} else {
-		return log_cout;
+		return log_cout.os;
 	}
 }
 
@@ -255,25 +489,50 @@ void logger::log(int severity, const char* format, va_list args)
 
 	char buf[256];
 	vsnprintf(buf, sizeof(buf), format, args);
-	log(severity) << buf;
+	// usually followed by progress_print(), which uses stdio
+	log(severity) << buf << flush;
 }
 
 void logger::log_io(const string& line, bool in)
 {
+	// may be called from multiple threads in parallel dumps
+	static mutex lock;
+	lock_guard<mutex> guard(lock);
+
+	// this is called for every line read from an interface, so the
+	// oldest line's storage is reused, rather than allocating a new one
 	if (s_lines.size() == 50) {
-		s_lines.pop_front();
+		s_lines.splice(s_lines.end(), s_lines, s_lines.begin());
+	} else {
+		s_lines.emplace_back();
 	}
 
-	s_lines.push_back((in ? "==> " : "<== ") + (line.empty() ?
-				"(empty)"s : ("'" + trim(line.c_str()) + "'")));
+	string& l = s_lines.back();
+	l.assign(in ? "==> " : "<== ");
+
+	if (line.empty()) {
+		l += "(empty)";
+	} else {
+		static string tline;
+		tline.assign(line.c_str());
+		l += '\'';
+		l += trim_in_place(tline);
+		l += '\'';
+	}
 
-	ostream& os = logbuf::file ? logbuf::file : log(trace);
+	ostream& os = logbuf::file.is_open() ? log_file.os : log(trace);
 	os << s_lines.back() << endl;
 }
 
 void logger::set_logfile(const string& filename)
 {
-	logbuf::file.open(filename.c_str());
+	lock_guard<mutex> guard(logbuf::lock);
+	logbuf::file.close();
+	logbuf::file.clear();
+
+	if (!filename.empty()) {
+		logbuf::file.open(filename.c_str());
+	}
 }
 
 string getaddrinfo_category::message(int condition) const
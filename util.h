@@ -21,6 +21,7 @@
 #define BCM2UTILS_UTIL_H
 #include <boost/endian/conversion.hpp>
 #include <boost/crc.hpp>
+#include <boost/utility/string_view.hpp>
 #include <system_error>
 #include <type_traits>
 #include <functional>
@@ -31,6 +32,7 @@
 #include <fstream>
 #include <sstream>
 #include <cstdarg>
+#include <limits>
 #include <chrono>
 #include <memory>
 #include <cerrno>
@@ -39,6 +41,10 @@
 #include <list>
 #include <ios>
 
+#if defined(__SSE2__) && defined(__OPTIMIZE__)
+#include <emmintrin.h>
+#endif
+
 #ifdef _WIN32
 #ifndef NOMINMAX
 #define NOMINMAX
@@ -68,28 +74,34 @@ namespace bcm2dump {
 typedef void (*sigh_type)(int);
 
 std::string trim(std::string str);
+// like trim(), but modifies `str` without allocating
+std::string& trim_in_place(std::string& str);
 std::vector<std::string> split(const std::string& str, char delim, bool empties = true, size_t limit = 0);
 
-inline bool contains(const std::string& haystack, const std::string& needle)
+// these are used on every line read from an interface, so the needle is
+// passed as a view, to avoid creating a temporary for string literals
+
+inline bool contains(const std::string& haystack, boost::string_view needle)
 {
-	return haystack.find(needle) != std::string::npos;
+	return haystack.find(needle.data(), 0, needle.size()) != std::string::npos;
 }
 
-inline bool starts_with(const std::string& haystack, const std::string& needle)
+inline bool starts_with(const std::string& haystack, boost::string_view needle)
 {
 	if (haystack.size() < needle.size()) {
 		return false;
 	} else {
-		return haystack.substr(0, needle.size()) == needle;
+		return !haystack.compare(0, needle.size(), needle.data(), needle.size());
 	}
 }
 
-inline bool ends_with(const std::string& haystack, const std::string& needle)
+inline bool ends_with(const std::string& haystack, boost::string_view needle)
 {
 	if (haystack.size() < needle.size()) {
 		return false;
 	} else {
-		return haystack.substr(haystack.size() - needle.size()) == needle;
+		return !haystack.compare(haystack.size() - needle.size(), needle.size(),
+				needle.data(), needle.size());
 	}
 }
 
@@ -114,24 +126,43 @@ class bad_lexical_cast : public std::invalid_argument
 	bad_lexical_cast(const std::string& str) : std::invalid_argument(str) {}
 };
 
+// parses an optionally signed integer at `p`, the way std::istream's
+// operator>> would (leading whitespace is skipped, and if `base` is 16,
+// a 0x prefix is accepted). on return, `p` points to the first character
+// that was not consumed. returns false if there are no digits, or if the
+// magnitude exceeds `max` (or `max_neg` for negative numbers).
+bool parse_integer(const char*& p, const char* end, unsigned base, uint64_t max,
+		uint64_t max_neg, bool& negative, uint64_t& magnitude);
+
+// this used to be implemented using a std::istringstream, which copied
+// every string it parsed. the behaviour is still the same.
 template<class T> T lexical_cast(const std::string& str, unsigned base = 10, bool all = true)
 {
-	static std::istringstream istr;
-	istr.clear();
-	istr.str(str);
-	T t;
+	static_assert(std::is_integral<T>::value, "lexical_cast requires an integral type");
+	typedef typename std::make_unsigned<T>::type U;
 
 	if (!base) {
-		if (str.size() > 2 && str.substr(0, 2) == "0x") {
+		if (str.size() > 2 && str.compare(0, 2, "0x") == 0) {
 			base = 16;
 		} else {
 			base = 10;
 		}
 	}
 
-	if ((istr >> std::setbase(base) >> t)) {
-		if (!istr.eof() && base == 10) {
-			switch (istr.get()) {
+	const char* p = str.data();
+	const char* end = p + str.size();
+	bool negative;
+	uint64_t magnitude;
+
+	uint64_t max = std::numeric_limits<T>::max();
+	// unsigned types accept negative numbers, which wrap around
+	uint64_t max_neg = std::is_signed<T>::value ? max + 1 : max;
+
+	if (parse_integer(p, end, base, max, max_neg, negative, magnitude)) {
+		T t = negative ? static_cast<T>(U(0) - U(magnitude)) : static_cast<T>(magnitude);
+
+		if (p != end && base == 10) {
+			switch (*p++) {
 			case 'k':
 			case 'K':
 				t *= 1024;
@@ -145,8 +176,7 @@ template<class T> T lexical_cast(const std::string& str, unsigned base = 10, boo
 			}
 		}
 
-		int c = istr.get() & 0xff;
-		if (!all || (istr.eof() || !c)) {
+		if (!all || p == end || !*p) {
 			return t;
 		}
 	}
@@ -154,7 +184,8 @@ template<class T> T lexical_cast(const std::string& str, unsigned base = 10, boo
 	throw bad_lexical_cast("conversion failed: '" + str + "' -> " + std::string(typeid(T).name()));
 }
 
-// without these, istr >> t will read only one char instead of parsing the number
+// for consistency with the old implementation, which had to parse these
+// as int16_t, since istr >> t would otherwise read only one char.
 
 template<> inline int8_t lexical_cast<int8_t>(const std::string& str, unsigned base, bool all)
 { return lexical_cast<int16_t>(str, base, all) & 0xff; }
@@ -182,6 +213,60 @@ template<> inline std::string to_hex<unsigned char>(const unsigned char& c, size
 std::string to_hex(const std::string& buffer);
 std::string from_hex(const std::string& hex);
 
+extern const int8_t hex_digit_values[256];
+
+// returns the value of a hex digit, or -1
+inline int hex_digit(char c)
+{ return hex_digit_values[static_cast<unsigned char>(c)]; }
+
+// parses a hex number of up to 8 digits (without prefix) at `p`. returns
+// the number of digits, or 0 if there are none, or too many. this is used
+// by all hex dump parsers, so it must not allocate.
+inline size_t parse_hex_u32(const char* p, const char* end, uint32_t& value)
+{
+	// without optimization, the intrinsics are slower than the loop below
+#if defined(__SSE2__) && defined(__OPTIMIZE__)
+	// most numbers in a hex dump have exactly 8 digits
+	if ((end - p) >= 8) {
+		__m128i c = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p));
+		__m128i d = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+		__m128i l = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+		__m128i is_d = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d);
+		__m128i is_l = _mm_cmpeq_epi8(_mm_min_epu8(l, _mm_set1_epi8(5)), l);
+
+		if ((_mm_movemask_epi8(_mm_or_si128(is_d, is_l)) & 0xff) == 0xff
+				&& ((end - p) == 8 || hex_digit(p[8]) < 0)) {
+			__m128i n = _mm_or_si128(_mm_and_si128(is_d, d),
+					_mm_and_si128(is_l, _mm_add_epi8(l, _mm_set1_epi8(10))));
+			// combine two digits into one byte, in each 16-bit lane
+			n = _mm_or_si128(_mm_and_si128(_mm_slli_epi16(n, 4), _mm_set1_epi16(0xf0)),
+					_mm_srli_epi16(n, 8));
+			n = _mm_packus_epi16(n, n);
+			value = boost::endian::big_to_native(static_cast<uint32_t>(_mm_cvtsi128_si32(n)));
+			return 8;
+		}
+	}
+#endif
+
+	uint32_t v = 0;
+	size_t i = 0;
+
+	// hex_digit() isn't inlined in unoptimized builds
+	for (int d; (p + i) < end && (d = hex_digit_values[static_cast<unsigned char>(p[i])]) >= 0; ++i) {
+		if (i == 8) {
+			return 0;
+		}
+
+		v = (v << 4) | d;
+	}
+
+	if (i) {
+		value = v;
+	}
+
+	return i;
+}
+
 // return the closest number lower than num that matches the requested alignment
 template<class T> T align_left(const T& num, size_t alignment)
 {
@@ -215,6 +300,14 @@ inline uint32_t crc32(const std::string& buf)
 	return crc_generic<boost::crc_32_type>(buf.data(), buf.size());
 }
 
+// returns the crc32 of two concatenated buffers, given the crc32 of
+// each buffer, and the length of the second one.
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, uint64_t len2);
+
+// returns the name of a file in bcm2dump's cache directory, which is
+// created if necessary. returns an empty string if there is none.
+std::string cache_filename(const std::string& name);
+
 class mstimer
 {
 	public:
@@ -370,6 +463,7 @@ class logger
 	static void no_stdout(bool no_stdout = true)
 	{ s_no_stdout = no_stdout; }
 
+	// closes the current log file, if any. an empty filename only closes it.
 	static void set_logfile(const std::string& filename);
 
 	static std::list<std::string> get_last_io_lines()